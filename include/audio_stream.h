@@ -15,6 +15,12 @@ typedef struct AudioPacket
 {
     float* data;
     int length;
+
+    // Stamped by the audio thread, so the GUI can tell when it'll be heard
+    guint64 position;   // Frames mixed before this one since audio was opened
+    gint64 time;        // When it was mixed (monotonic, in microseconds)
+    int rate;           // Frames per second the device is really playing
+    int latency;        // Frames the device is buffering ahead of the speakers
 } AudioPacket;
 
 AudioStream* create_audio_stream(PlaylistEntry* entry);
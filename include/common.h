@@ -9,7 +9,8 @@
 #define CHANNELS 2
 #define FADE_DURATION_MS 200
 
-// Leads to smooth "playback paused" animation at the cost of idle CPU usage
+// Keeps analysing (silent) audio while paused, at the cost of idle CPU usage;
+// the bars fade out on pause either way
 #define CONTINUE_VISUALISATION_WHEN_PAUSED 0
 
 // Avoid the Bark scale resulting in some bars being wider than others by
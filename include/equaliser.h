@@ -1,6 +1,20 @@
 #pragma once
 #include "audio_stream.h"
+#include "preferences.h"
 
 void equaliser_init();
-void equaliser_process_packet(AudioPacket* packet);
+void equaliser_reset();
+void equaliser_process_packet(AudioPacket* packet, const DspConfig* config);
 void equaliser_destroy();
+
+/*
+    Built on a worker thread (it's a lot of work for a long recording), then
+    only referenced and freed on the GTK thread, and immutable throughout, so
+    it can sit in a DspConfig snapshot. The audio thread keeps the running
+    state (delay line and buffers) itself, for one convolver at a time, and
+    starts afresh whenever it's handed a different one.
+*/
+Convolver* convolver_new(const char* path);
+Convolver* convolver_ref(Convolver* convolver);
+void convolver_unref(Convolver* convolver);
+void convolver_process_packet(const Convolver* convolver, AudioPacket* packet);
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdbool.h>
+#include <adwaita.h>
+
+/*
+    Whatever probing a track found out, remembered between runs so that a
+    playlist can be reopened without reading any of its files again. It's a
+    single append-only file of records, mapped in at start-up, and a record
+    only counts for as long as the file's size and modification time match.
+*/
+
+typedef struct TrackMetadata
+{
+    const gchar* title;  // Empty when untagged
+    const gchar* artist; // Likewise
+    double duration;     // Seconds, or -1 if unknown
+    int sample_rate;     // 0 if unknown
+    int codec;           // Mix_MusicType
+    gint64 size;
+    gint64 modified;
+} TrackMetadata;
+
+void init_metadata_cache();
+void free_metadata_cache();
+
+// Strings stay valid until free_metadata_cache. Doesn't touch the file
+// itself, so what's found is only provisional until checked against a stamp.
+bool metadata_cache_lookup(const char* path, TrackMetadata* metadata);
+
+// Call before probing (and pass the result to the store), so that a file
+// changing mid-probe doesn't get cached under its new size and time
+bool metadata_cache_stamp(const char* path, TrackMetadata* metadata);
+
+// Whether a record still describes the file as it was when stamped
+bool metadata_cache_is_current(const TrackMetadata* cached, const TrackMetadata* stamp);
+
+// Safe from any thread
+void metadata_cache_store(const char* path, const TrackMetadata* metadata);
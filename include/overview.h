@@ -0,0 +1,24 @@
+#pragma once
+#include <adwaita.h>
+
+/*
+    A whole-track amplitude envelope for drawing behind the seek bar. Tracks
+    are decoded on a worker thread and the result is cached on disk, keyed by
+    path, size and modification time, so revisiting one is near instant.
+*/
+
+#define OVERVIEW_BUCKETS 1024
+
+typedef struct Overview
+{
+    float minimum[OVERVIEW_BUCKETS];
+    float maximum[OVERVIEW_BUCKETS];
+    float rms[OVERVIEW_BUCKETS];
+} Overview;
+
+// Called on the GTK thread; the overview belongs to the callee (g_free it)
+typedef void (*OverviewCallback)(Overview* overview);
+
+// Replaces any request still in flight
+void overview_request(const char* path, OverviewCallback callback);
+void overview_cancel();
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdbool.h>
+#include "audio_stream.h"
+
+/*
+    Single-producer, single-consumer ring of fixed-size packets. The SDL audio
+    callback pushes and the GTK thread peeks and pops, so neither side ever
+    allocates, locks or has to wait on the other. The GTK thread empties it on
+    every tick, so it only has to cover the gaps between them.
+*/
+
+#define PACKET_QUEUE_LENGTH 16
+
+// Audio thread
+void packet_queue_push(const AudioPacket* packet);
+
+// GTK thread
+AudioPacket* packet_queue_peek();
+void packet_queue_pop();
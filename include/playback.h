@@ -2,7 +2,7 @@
 #include <adwaita.h>
 #include "audio_stream.h"
 
-typedef struct PlaylistEntry PlaylistEntry;
+typedef struct _PlaylistEntry PlaylistEntry;
 
 void init_playback_ui(GtkBuilder* builder);
 void destroy_playback_ui();
@@ -10,7 +10,7 @@ void destroy_playback_ui();
 void update_playback();
 void toggle_playback();
 void set_new_playback_entry(PlaylistEntry* entry);
-void on_audio_stream_advanced(AudioPacket* packet);
+void playback_update_visualiser_renderer();
 
 // D-Bus
 void playback_next();
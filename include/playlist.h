@@ -1,15 +1,26 @@
 #pragma once
 #include <adwaita.h>
 
-typedef struct PlaylistEntry
+#define WAVEFORM_TYPE_PLAYLIST_ENTRY (playlist_entry_get_type())
+G_DECLARE_FINAL_TYPE(PlaylistEntry, playlist_entry, WAVEFORM, PLAYLIST_ENTRY, GObject)
+
+struct _PlaylistEntry
 {
+    GObject parent_instance;
     const gchar* name;
     const gchar* unescaped_name;
     const gchar* artist;
     const gchar* unescaped_artist;
     const gchar* path;
-} PlaylistEntry;
-extern GList* playlist;
+    double duration; // Seconds, or -1 if not known yet
+    guint index; // Where it is in the playlist, kept up to date as that changes
+    GtkWidget* row; // Whichever list view row is showing it, if any
+};
+
+// Contiguous, so any entry (and any entry's neighbours) is a single lookup
+extern GPtrArray* playlist;
+
+bool playlist_contains(const PlaylistEntry* entry);
 
 void init_playlist_ui(GtkBuilder* builder, GtkWindow* window);
 void destroy_playlist_ui();
@@ -5,9 +5,28 @@
 typedef enum VisualisationType
 {
     VISUALISATION_TYPE_TIME_DOMAIN,
-    VISUALISATION_TYPE_FREQUENCY_DOMAIN
+    VISUALISATION_TYPE_FREQUENCY_DOMAIN,
+    VISUALISATION_TYPE_SPECTROGRAM
 } VisualisationType;
 
+typedef enum VisualiserRenderer
+{
+    VISUALISER_RENDERER_CAIRO,
+    VISUALISER_RENDERER_SNAPSHOT
+} VisualiserRenderer;
+
+typedef enum AnalyserWindow
+{
+    ANALYSER_WINDOW_HANN,
+    ANALYSER_WINDOW_BLACKMAN
+} AnalyserWindow;
+
+typedef enum EqualiserMode
+{
+    EQUALISER_MODE_FFT,
+    EQUALISER_MODE_IIR
+} EqualiserMode;
+
 typedef struct __attribute__((__packed__)) FrequencyRange
 {
     double minimum;
@@ -15,21 +34,51 @@ typedef struct __attribute__((__packed__)) FrequencyRange
     double multiplier;
 } FrequencyRange;
 
+typedef struct Convolver Convolver;
+
+/*
+    Immutable snapshot of everything the audio thread needs. A new one is
+    built on the GTK thread whenever the relevant settings change, and old
+    ones are only freed once the audio thread is no longer reading them.
+*/
+typedef struct DspConfig
+{
+    unsigned int version;
+    bool equaliser_enabled;
+    EqualiserMode equaliser_mode;
+    int equaliser_latency;
+    Convolver* convolver; // NULL when disabled; read-only here (see equaliser.h)
+    size_t n_frequency_ranges;
+    FrequencyRange frequency_ranges[];
+} DspConfig;
+
 void init_preferences();
 void toggle_preferences_window();
 void free_preferences();
 
 int                     preferences_get_gap_size();
 VisualisationType       preferences_get_visualisation_type();
+VisualiserRenderer      preferences_get_visualiser_renderer();
 bool                    preferences_get_fade_edges();
 int                     preferences_get_minimum_frequency();
 int                     preferences_get_maximum_frequency();
 bool                    preferences_get_use_bark_scale();
 float                   preferences_get_gain();
+int                     preferences_get_analyser_size();
+AnalyserWindow          preferences_get_analyser_window();
+int                     preferences_get_analyser_hop();
+bool                    preferences_get_use_constant_q();
+int                     preferences_get_spectrogram_history();
+bool                    preferences_get_oscilloscope_trigger();
+int                     preferences_get_smoothing_frames();
+int                     preferences_get_smoothing_attack();
+int                     preferences_get_smoothing_release();
 float                   preferences_get_playback_speed();
-bool                    preferences_get_equaliser_enabled();
-int                     preferences_get_n_frequency_ranges();
-const FrequencyRange*   preferences_get_frequency_ranges();
 void                    preferences_force_frequency_range_ui_update();
+void                    preferences_reload_impulse_response();
+
+// Audio thread only; never blocks or allocates
+const DspConfig*        preferences_acquire_dsp_config();
+void                    preferences_release_dsp_config();
 
 void preferences_set_frequency_ranges(const FrequencyRange* ranges, size_t n);
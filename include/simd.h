@@ -0,0 +1,11 @@
+#pragma once
+
+// Splits interleaved samples into one buffer per channel
+void simd_deinterleave(const float* input, float* const* outputs, int n_channels, int n_samples);
+
+// Joins one buffer per channel back into interleaved samples
+void simd_interleave(const float* const* inputs, float* output, int n_channels, int n_samples);
+
+// Folds samples into a running minimum, maximum and sum of squares (which
+// may be NULL, to skip working it out)
+void simd_reduce_envelope(const float* samples, int n_samples, float* minimum, float* maximum, float* sum_squares);
@@ -11,5 +11,22 @@ void visualiser_draw_function(
 );
 
 void visualiser_init(GtkWidget* widget);
+void visualiser_set_widget(GtkWidget* widget);
 void visualiser_set_data(AudioPacket* packet);
-void visualiser_free_data();
\ No newline at end of file
+
+// Returns whether the key was one of the visualiser's
+bool visualiser_setting_changed(const char* key);
+
+// Fades the bars out while paused; returns whether a redraw is needed
+void visualiser_set_paused(bool paused);
+bool visualiser_animate(gint64 frame_time);
+void visualiser_free_data();
+
+// Runs the visualiser with each renderer and prints how long frames took
+void visualiser_benchmark(int width, int height, int n_frames);
+
+// Snapshot-based alternative to the drawing area
+#define WAVEFORM_TYPE_VISUALISER waveform_visualiser_get_type()
+G_DECLARE_FINAL_TYPE(WaveformVisualiser, waveform_visualiser, WAVEFORM, VISUALISER, GtkWidget)
+
+GtkWidget* waveform_visualiser_new();
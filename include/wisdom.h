@@ -0,0 +1,6 @@
+#pragma once
+
+// Persists FFTW wisdom in the user's cache directory so that measured plans
+// only need to be worked out once
+void wisdom_load();
+void wisdom_save();
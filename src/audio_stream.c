@@ -1,7 +1,7 @@
 #include "audio_stream.h"
 #include "preferences.h"
 #include "equaliser.h"
-#include "playback.h"
+#include "packet_queue.h"
 #include "common.h"
 #include "dbus.h"
 #include <stdio.h>
@@ -10,6 +10,8 @@
 #include <SDL2/SDL.h>
 
 static bool muted = false;
+static bool equaliser_active = false;
+static guint64 mixed_frames = 0; // Audio thread only
 
 AudioStream* create_audio_stream(PlaylistEntry* entry)
 {
@@ -36,25 +38,34 @@ AudioStream* create_audio_stream(PlaylistEntry* entry)
     return stream;
 }
 
-static void gui_idle_callback(gpointer audio_packet)
-{
-    AudioPacket* packet = (AudioPacket*)audio_packet;
-    on_audio_stream_advanced(packet);
-    free(packet);
-}
-
 static void on_effect_called(int, void* buffer, int length, void*)
 {
-    // Create packet
-    AudioPacket* packet = malloc(sizeof(AudioPacket));
-    packet->data = (float*)buffer;
-    packet->length = length / sizeof(packet->data[0]);
-
-    if (preferences_get_equaliser_enabled() && preferences_get_n_frequency_ranges() > 0)
-        equaliser_process_packet(packet);
-
-    // Enqueue work to GUI thread
-    g_idle_add_once(gui_idle_callback, packet);
+    // Wrap SDL's buffer; nothing here may allocate
+    AudioPacket packet;
+    packet.data = (float*)buffer;
+    packet.length = length / sizeof(packet.data[0]);
+    packet.position = mixed_frames;
+    packet.time = g_get_monotonic_time();
+    Mix_GetDeviceTiming(&packet.rate, &packet.latency);
+    mixed_frames += packet.length / CHANNELS;
+
+    const DspConfig* config = preferences_acquire_dsp_config();
+    bool use_equaliser = config->equaliser_enabled && config->n_frequency_ranges > 0;
+
+    // Don't let stale history from when it was last used leak through
+    if (use_equaliser && !equaliser_active)
+        equaliser_reset();
+    equaliser_active = use_equaliser;
+
+    if (use_equaliser)
+        equaliser_process_packet(&packet, config);
+    if (config->convolver != NULL)
+        convolver_process_packet(config->convolver, &packet);
+    preferences_release_dsp_config();
+
+    // Hand a copy over to the GUI thread (see on_audio_stream_advanced). It's
+    // been through the equaliser already, so its delay needs no correcting.
+    packet_queue_push(&packet);
 
     // Simulate being muted
     if (muted)
@@ -116,6 +127,18 @@ void init_audio()
         PACKET_SIZE      // chunk size
     );
 
+    /*
+        SDL_mixer otherwise loads each codec the first time it's needed, with
+        nothing to stop two threads doing so at once, and files are opened by
+        the playlist's probes and the overview task as well as from here. So
+        load them all now, before any of those threads exist. WAV comes with
+        opening the audio; anything not built in is simply skipped.
+    */
+    Mix_Init(
+        MIX_INIT_FLAC | MIX_INIT_MOD | MIX_INIT_MP3 | MIX_INIT_OGG |
+        MIX_INIT_MID | MIX_INIT_OPUS | MIX_INIT_WAVPACK
+    );
+
 #if CONTINUE_VISUALISATION_WHEN_PAUSED
     Mix_RegisterEffect(
         MIX_CHANNEL_POST,
@@ -129,6 +152,9 @@ void init_audio()
 
     equaliser_init();
 
+    // Needs the device's format, so can only be loaded now
+    preferences_reload_impulse_response();
+
     float fps = (float)AUDIO_FREQUENCY / (float)PACKET_SIZE;
     printf("running at approx. %.2f FPS\n", fps);
 }
@@ -155,4 +181,5 @@ void close_audio()
 {
     equaliser_destroy();
     Mix_CloseAudio();
+    Mix_Quit();
 }
\ No newline at end of file
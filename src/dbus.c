@@ -275,7 +275,7 @@ static GVariant* get_metadata_for_current_entry()
         GVariant* artist_string = g_variant_new_string(current_entry->unescaped_artist);
         GVariant* artist_array = g_variant_new_array(G_VARIANT_TYPE_STRING, &artist_string, 1);
 
-        GVariant* entries[] = {
+        GVariant* entries[4] = {
             new_metadata_string("mpris:trackid", "/org/mpris/MediaPlayer2/CurrentTrack"),
             new_metadata_string("xesam:title", current_entry->unescaped_name),
             g_variant_new_dict_entry(
@@ -283,8 +283,16 @@ static GVariant* get_metadata_for_current_entry()
                 g_variant_new_variant(artist_array)
             )
         };
+        gsize n_entries = 3;
+
+        // Only known once probed (or cached), and in microseconds
+        if (current_entry->duration > 0.0)
+            entries[n_entries++] = g_variant_new_dict_entry(
+                g_variant_new_string("mpris:length"),
+                g_variant_new_variant(g_variant_new_int64((gint64)(current_entry->duration * G_USEC_PER_SEC)))
+            );
 
-        return g_variant_new_array(G_VARIANT_TYPE("{sv}"), entries, 3);
+        return g_variant_new_array(G_VARIANT_TYPE("{sv}"), entries, n_entries);
     }
 }
 
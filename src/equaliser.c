@@ -1,195 +1,799 @@
 #include "equaliser.h"
 #include "preferences.h"
 #include "common.h"
+#include "simd.h"
 #include <adwaita.h>
+#include <SDL_mixer.h>
 #include <complex.h>
+#include <math.h>
 #include <fftw3.h>
 
 /*
-    The equaliser effect requires having access to both the previous packet
-    and the next packet. Unfortunately, I cannot be bothered patching SDL_mixer
-    to achieve this. Instead, let's just cache the previous two buffers, and
-    live with a delay. It should only be 2 frames anyway (i.e. 30ish ms).
+    The equaliser is a weighted overlap-add STFT. Samples are collected for
+    each channel until a "hop" has arrived, at which point the last frame (two
+    hops) is windowed, transformed, modified, transformed back, windowed again
+    and added onto the output.
+
+    The same sine window is used for analysis and synthesis, and as sin² + cos²
+    = 1, overlapping frames always sum back to the original signal. That keeps
+    the seams between frames click-free whatever is done to the spectrum. The
+    cost is a delay of one frame, which the user can trade against frequency
+    resolution by picking the hop size.
+
+    All channels are transformed together by a single batched plan, over one
+    planar buffer. The frequency ranges themselves are compiled into a single
+    gain per bin whenever they change, so filtering a frame is just one
+    multiply per bin.
+
+    Alternatively, the ranges can be turned into a cascade of biquads, which
+    adds no latency at all at the expense of gentler edges.
+
+    After the equaliser, an impulse response can be applied with a uniformly
+    partitioned convolution (overlap-save). The impulse response is split into
+    blocks, each transformed once up front; every incoming block is transformed
+    once too, and kept in a "frequency-domain delay line" so that convolving is
+    just a sum of complex products per partition. The delay is one block.
+
+    Only the first partition needs the block that has just arrived; the rest
+    only need older ones, so their share of the next block's output is worked
+    out bit by bit as its samples come in. Each callback then does work in
+    proportion to the samples it was handed, rather than whichever one happens
+    to complete a block doing the lot.
+*/
+
+#define N_LATENCIES 4
+#define MAX_HOP_SIZE 1024
+#define MAX_FRAME_SIZE (MAX_HOP_SIZE * 2)
+
+// Width of the raised-cosine shoulders either side of each frequency range
+#define TRANSITION_BINS 2.0f
+
+// Ranges reaching these are treated as shelves (or filters, if muted)
+#define SHELF_LOWER_FREQUENCY 20.0f
+#define SHELF_UPPER_FREQUENCY 20000.0f
+#define MUTED_MULTIPLIER 0.01f
+#define MINIMUM_MULTIPLIER 0.001f
+
+/*
+    Channels are filtered together, one SIMD lane each. Packets are processed
+    in blocks so that each biquad can run over a whole block at once whilst its
+    state stays in registers.
 */
+#define MAX_BIQUADS 32
+#define IIR_LANES 4
+#define IIR_GROUPS ((CHANNELS + IIR_LANES - 1) / IIR_LANES)
+#define IIR_BLOCK_SIZE 256
 
-static float* previous_packets[2];
-static int n_packets = 0;
+typedef float LaneVector __attribute__((vector_size(sizeof(float) * IIR_LANES)));
 
-static float* samples_buffer = NULL;
-static float* output_buffer = NULL;
-static fftwf_complex* left_fft = NULL;
-static fftwf_complex* right_fft = NULL;
-static float* left_ifft = NULL;
-static float* right_ifft = NULL;
+typedef struct Biquad
+{
+    float b0, b1, b2, a1, a2;
+} Biquad;
 
-static float* apply_equaliser(float* previous, float* current, float* next);
-static void modify_frequency_range(float min, float max, float multipiler);
-static float complex modify_magnitude(float complex c, float multiplier);
+#define CONVOLUTION_BLOCK_SIZE 512
+#define CONVOLUTION_FFT_SIZE (CONVOLUTION_BLOCK_SIZE * 2)
+#define CONVOLUTION_BINS (CONVOLUTION_FFT_SIZE / 2 + 1)
+#define MAX_IMPULSE_RESPONSE_SECONDS 10
+#define MAX_CONVOLUTION_PARTITIONS \
+    ((AUDIO_FREQUENCY * MAX_IMPULSE_RESPONSE_SECONDS + CONVOLUTION_BLOCK_SIZE - 1) / CONVOLUTION_BLOCK_SIZE)
+
+/*
+    Built on the GTK thread and shared between DSP snapshots, so it is only
+    ever referenced and freed there. Nothing in it changes once built; the
+    audio thread keeps its running state separately (below).
+*/
+struct Convolver
+{
+    int references;
+    unsigned int id;
+    int n_partitions;
+
+    // [partition][channel][bin], planar like the equaliser
+    fftwf_complex* impulse_spectra;
+};
+
+static const int hop_sizes[N_LATENCIES] = { 128, 256, 512, 1024 };
+static fftwf_plan forward_plans[N_LATENCIES];
+static fftwf_plan inverse_plans[N_LATENCIES];
+
+static int latency = -1;
+static int hop_size;
+static int frame_size;
+
+// Per-channel history, all preallocated for the largest frame size
+static float* input_history[CHANNELS];
+static float* output_overlap[CHANNELS];
+static float* output_ready[CHANNELS];
+static int hop_position = 0;
+
+// Planar, with each channel's frame (or spectrum) directly after the last
+static float* window = NULL;
+static float* frames = NULL;
+static fftwf_complex* spectra = NULL;
+
+// Snapshot versions start at 1, so 0 means "needs rebuilding"
+static float* gain_mask = NULL;
+static unsigned int gain_mask_version = 0;
+
+static EqualiserMode mode = EQUALISER_MODE_FFT;
+
+static Biquad biquads[MAX_BIQUADS];
+static LaneVector biquad_state[IIR_GROUPS][MAX_BIQUADS][2];
+static LaneVector iir_block[IIR_BLOCK_SIZE];
+static int n_biquads = 0;
+static unsigned int biquads_version = 0;
+
+// Scratch space for the convolver, in the same layout as its buffers
+static float* convolution_frames = NULL;
+static fftwf_complex* convolution_spectra = NULL;
+static fftwf_plan convolution_forward_plan = NULL;
+static fftwf_plan convolution_inverse_plan = NULL;
+static gint next_convolver_id = 1; // Convolvers are built on worker threads
+
+/*
+    Audio thread state for whichever convolver it was last handed, reset when
+    that changes. The delay line has room for the longest impulse response,
+    but only the slots actually used ever get touched (and so paged in).
+*/
+static unsigned int convolver_id = 0;
+static fftwf_complex* delay_line = NULL; // [slot][channel][bin]
+static int delay_line_position = 0; // Where the next block goes
+static int n_blocks_seen = 0; // Older slots are left over from before a reset
+static int n_partitions_done = 0; // Towards the next block's output
+static float* convolution_input = NULL; // [channel][sample]; previous block then current
+static float* convolution_output_ready[CHANNELS];
+static int convolution_block_position = 0;
+
+static void set_latency(int new_latency);
+static void build_gain_mask(const DspConfig* config);
+static float get_range_weight(float frequency, float min, float max, float transition);
+static void process_fft_packet(AudioPacket* packet);
+static void process_frame();
+
+static void build_biquads(const DspConfig* config);
+static Biquad design_biquad(const FrequencyRange* range);
+static void process_iir_packet(AudioPacket* packet);
+static void run_biquad(const Biquad* biquad, LaneVector* state, int n_samples);
+
+static void reset_convolution(const Convolver* convolver);
+static void accumulate_partitions(const Convolver* convolver, int up_to);
+static void process_convolution_block(const Convolver* convolver);
 
 void equaliser_init()
 {
-    samples_buffer = malloc(sizeof(float) * PACKET_SIZE * CHANNELS * 3);
-    left_fft = fftwf_alloc_complex(PACKET_SIZE * 3);
-    right_fft = fftwf_alloc_complex(PACKET_SIZE * 3);
-    left_ifft = fftwf_alloc_real(PACKET_SIZE * 3);
-    right_ifft = fftwf_alloc_real(PACKET_SIZE * 3);
-    output_buffer = malloc(sizeof(float) * PACKET_SIZE * CHANNELS);
+    window = malloc(sizeof(float) * MAX_FRAME_SIZE);
+    frames = fftwf_alloc_real(MAX_FRAME_SIZE * CHANNELS);
+    spectra = fftwf_alloc_complex((MAX_FRAME_SIZE / 2 + 1) * CHANNELS);
+    gain_mask = malloc(sizeof(float) * (MAX_FRAME_SIZE / 2 + 1));
+
+    for (int c = 0; c < CHANNELS; ++c)
+    {
+        input_history[c] = malloc(sizeof(float) * MAX_FRAME_SIZE);
+        output_overlap[c] = malloc(sizeof(float) * MAX_FRAME_SIZE);
+        output_ready[c] = malloc(sizeof(float) * MAX_HOP_SIZE);
+    }
+
+    /*
+        Planning is far slower than the transforms themselves and takes FFTW's
+        global lock, so do it once here for every frame size rather than on the
+        audio thread. Any wisdom from previous runs will make measuring
+        near-instant.
+    */
+    for (int i = 0; i < N_LATENCIES; ++i)
+    {
+        int size = hop_sizes[i] * 2;
+        int n_bins = size / 2 + 1;
+
+        forward_plans[i] = fftwf_plan_many_dft_r2c(
+            1, &size, CHANNELS,
+            frames, NULL, 1, size,
+            spectra, NULL, 1, n_bins,
+            FFTW_MEASURE
+        );
+        inverse_plans[i] = fftwf_plan_many_dft_c2r(
+            1, &size, CHANNELS,
+            spectra, NULL, 1, n_bins,
+            frames, NULL, 1, size,
+            FFTW_MEASURE
+        );
+    }
+
+    // Likewise for the convolver's single block size
+    int convolution_size = CONVOLUTION_FFT_SIZE;
+    convolution_frames = fftwf_alloc_real(CONVOLUTION_FFT_SIZE * CHANNELS);
+    convolution_spectra = fftwf_alloc_complex(CONVOLUTION_BINS * CHANNELS);
+    convolution_forward_plan = fftwf_plan_many_dft_r2c(
+        1, &convolution_size, CHANNELS,
+        convolution_frames, NULL, 1, CONVOLUTION_FFT_SIZE,
+        convolution_spectra, NULL, 1, CONVOLUTION_BINS,
+        FFTW_MEASURE
+    );
+    convolution_inverse_plan = fftwf_plan_many_dft_c2r(
+        1, &convolution_size, CHANNELS,
+        convolution_spectra, NULL, 1, CONVOLUTION_BINS,
+        convolution_frames, NULL, 1, CONVOLUTION_FFT_SIZE,
+        FFTW_MEASURE
+    );
+
+    delay_line = fftwf_alloc_complex((size_t)MAX_CONVOLUTION_PARTITIONS * CHANNELS * CONVOLUTION_BINS);
+    convolution_input = fftwf_alloc_real(CONVOLUTION_FFT_SIZE * CHANNELS);
+    for (int c = 0; c < CHANNELS; ++c)
+        convolution_output_ready[c] = malloc(sizeof(float) * CONVOLUTION_BLOCK_SIZE);
 }
 
-void equaliser_process_packet(AudioPacket* packet)
+void equaliser_reset()
 {
-    g_assert(packet->length / CHANNELS == PACKET_SIZE);
-    size_t size = sizeof(packet->data[0]) * packet->length;
+    for (int c = 0; c < CHANNELS; ++c)
+    {
+        memset(input_history[c], 0, sizeof(float) * MAX_FRAME_SIZE);
+        memset(output_overlap[c], 0, sizeof(float) * MAX_FRAME_SIZE);
+        memset(output_ready[c], 0, sizeof(float) * MAX_HOP_SIZE);
+    }
+    hop_position = 0;
+
+    memset(biquad_state, 0, sizeof(biquad_state));
+}
 
-    // If not "satiated" yet, fill buffer
-    if (n_packets != 2)
+void equaliser_process_packet(AudioPacket* packet, const DspConfig* config)
+{
+    if (config->equaliser_mode != mode)
     {
-        previous_packets[n_packets] = malloc(size);
-        memcpy(previous_packets[n_packets], packet->data, size);
-        n_packets++;
+        mode = config->equaliser_mode;
+        equaliser_reset();
+    }
 
-        memset(packet->data, 0, size);
+    if (mode == EQUALISER_MODE_IIR)
+    {
+        if (config->version != biquads_version)
+            build_biquads(config);
+
+        process_iir_packet(packet);
         return;
     }
 
-    float* result = apply_equaliser(
-        previous_packets[0],
-        previous_packets[1],
-        packet->data
-    );
+    if (config->equaliser_latency != latency)
+        set_latency(config->equaliser_latency);
+
+    if (config->version != gain_mask_version)
+        build_gain_mask(config);
+
+    process_fft_packet(packet);
+}
+
+static void process_fft_packet(AudioPacket* packet)
+{
+    int n_samples = packet->length / CHANNELS;
+    int position = 0;
+
+    while (position < n_samples)
+    {
+        int count = MIN(n_samples - position, hop_size - hop_position);
+        float* samples = packet->data + position * CHANNELS;
+
+        float* inputs[CHANNELS];
+        const float* outputs[CHANNELS];
+        for (int c = 0; c < CHANNELS; ++c)
+        {
+            inputs[c] = input_history[c] + frame_size - hop_size + hop_position;
+            outputs[c] = output_ready[c] + hop_position;
+        }
+
+        // Swap incoming samples for ones processed a frame ago
+        simd_deinterleave(samples, inputs, CHANNELS, count);
+        simd_interleave(outputs, samples, CHANNELS, count);
+
+        position += count;
+        hop_position += count;
+
+        if (hop_position == hop_size)
+        {
+            process_frame();
+            hop_position = 0;
+        }
+    }
+}
+
+static void set_latency(int new_latency)
+{
+    latency = CLAMP(new_latency, 0, N_LATENCIES - 1);
+    hop_size = hop_sizes[latency];
+    frame_size = hop_size * 2;
+
+    // Periodic sine window; sums to one (squared) at 50% overlap
+    for (int i = 0; i < frame_size; ++i)
+        window[i] = sinf(G_PI * (float)i / (float)frame_size);
+
+    // Old history (and bins) are meaningless at a different frame size
+    equaliser_reset();
+    gain_mask_version = 0;
+}
+
+static void build_gain_mask(const DspConfig* config)
+{
+    int n_bins = frame_size / 2 + 1;
+    float frequency_resolution = (float)AUDIO_FREQUENCY / (float)frame_size;
+    float transition = frequency_resolution * TRANSITION_BINS;
+
+    // FFTW does not normalise, so fold the round trip's scaling in here too
+    float scale = 1.0f / (float)frame_size;
+    for (int i = 0; i < n_bins; ++i)
+        gain_mask[i] = scale;
+
+    // Overlapping ranges compound, as if applied one after the other
+    for (size_t r = 0; r < config->n_frequency_ranges; ++r)
+    {
+        const FrequencyRange* range = &config->frequency_ranges[r];
+        for (int i = 0; i < n_bins; ++i)
+        {
+            float weight = get_range_weight(
+                (float)i * frequency_resolution,
+                range->minimum,
+                range->maximum,
+                transition
+            );
+            gain_mask[i] *= 1.0f + ((float)range->multiplier - 1.0f) * weight;
+        }
+    }
 
-    // Shift packets along
-    memcpy(previous_packets[0], previous_packets[1], size);
-    memcpy(previous_packets[1], packet->data, size);
-    memcpy(packet->data, result, size);
+    gain_mask_version = config->version;
 }
 
-static float* apply_equaliser(float* previous, float* current, float* next)
+static float get_range_weight(float frequency, float min, float max, float transition)
 {
     /*
-        We want to join together the previous, current and next packets,
-        whilst also keeping the channels separate.
-
-        ----------------
-        | left | right |
-        ----------------
-           |
-           v
-        -----------------------------
-        | previous | current | next |
-        -----------------------------
+        Fully within the range gives 1, fading out to 0 over the transition.
+        Hard edges would give the filter a long impulse response, which the
+        windowing would then smear across the frame.
     */
+    float distance;
+    if (frequency < min)
+        distance = min - frequency;
+    else if (frequency > max)
+        distance = frequency - max;
+    else
+        return 1.0f;
 
-    g_assert(CHANNELS == 2);
-
-    // Fill samples buffer
-    #define FILL for (int i = 0; i < PACKET_SIZE; ++i)
-    FILL samples_buffer[PACKET_SIZE * 0 + i] = previous[i * 2]; // left ear previous
-    FILL samples_buffer[PACKET_SIZE * 1 + i] = current[i * 2]; // left ear current
-    FILL samples_buffer[PACKET_SIZE * 2 + i] = next[i * 2]; // left ear next
-    FILL samples_buffer[PACKET_SIZE * 3 + i] = previous[i * 2 + 1]; // right ear previous
-    FILL samples_buffer[PACKET_SIZE * 4 + i] = current[i * 2 + 1]; // right ear current
-    FILL samples_buffer[PACKET_SIZE * 5 + i] = next[i * 2 + 1]; // right ear next
-
-    // Perform FFT for each channel
-    fftwf_plan plan_left = fftwf_plan_dft_r2c_1d(
-        PACKET_SIZE * 3,
-        samples_buffer,
-        left_fft,
-        FFTW_ESTIMATE
-    );
-    fftwf_plan plan_right = fftwf_plan_dft_r2c_1d(
-        PACKET_SIZE * 3,
-        samples_buffer + PACKET_SIZE * 3,
-        right_fft,
-        FFTW_ESTIMATE
-    );
-    fftwf_execute_dft_r2c(plan_left, samples_buffer, left_fft);
-    fftwf_execute_dft_r2c(plan_right, samples_buffer + PACKET_SIZE * 3, right_fft);
-    fftwf_destroy_plan(plan_left);
-    fftwf_destroy_plan(plan_right);
-
-    // Modify audio in time domain
-    int n_ranges = preferences_get_n_frequency_ranges();
-    const FrequencyRange* ranges = preferences_get_frequency_ranges();
-    for (int i = 0;  i < n_ranges; ++i)
-        modify_frequency_range(
-            ranges[i].minimum,
-            ranges[i].maximum,
-            ranges[i].multiplier
-        );
+    if (distance >= transition)
+        return 0.0f;
 
-    // Convert back to frequency domain
-    fftwf_plan inverse_plan_left = fftwf_plan_dft_c2r_1d(
-        PACKET_SIZE * 3,
-        left_fft,
-        left_ifft,
-        FFTW_ESTIMATE
-    );
-    fftwf_plan inverse_plan_right = fftwf_plan_dft_c2r_1d(
-        PACKET_SIZE * 3,
-        right_fft,
-        right_ifft,
-        FFTW_ESTIMATE
-    );
-    fftwf_execute_dft_c2r(inverse_plan_left, left_fft, left_ifft);
-    fftwf_execute_dft_c2r(inverse_plan_right, right_fft, right_ifft);
-    fftwf_destroy_plan(inverse_plan_left);
-    fftwf_destroy_plan(inverse_plan_right);
+    return 0.5f + 0.5f * cosf(G_PI * distance / transition);
+}
+
+static void process_frame()
+{
+    int n_bins = frame_size / 2 + 1;
+    int overlap = frame_size - hop_size;
+
+    for (int c = 0; c < CHANNELS; ++c)
+    {
+        float* frame = frames + c * frame_size;
+        for (int i = 0; i < frame_size; ++i)
+            frame[i] = input_history[c][i] * window[i];
+    }
+
+    fftwf_execute_dft_r2c(forward_plans[latency], frames, spectra);
+
+    for (int c = 0; c < CHANNELS; ++c)
+    {
+        fftwf_complex* spectrum = spectra + c * n_bins;
+        for (int i = 0; i < n_bins; ++i)
+            spectrum[i] *= gain_mask[i];
+    }
+
+    fftwf_execute_dft_c2r(inverse_plans[latency], spectra, frames);
+
+    for (int c = 0; c < CHANNELS; ++c)
+    {
+        // Overlap-add; the first hop is now complete
+        float* frame = frames + c * frame_size;
+        float* accumulator = output_overlap[c];
+        for (int i = 0; i < frame_size; ++i)
+            accumulator[i] += frame[i] * window[i];
+
+        memcpy(output_ready[c], accumulator, sizeof(float) * hop_size);
+        memmove(accumulator, accumulator + hop_size, sizeof(float) * overlap);
+        memset(accumulator + overlap, 0, sizeof(float) * hop_size);
+
+        // Make room for the next hop
+        memmove(input_history[c], input_history[c] + hop_size, sizeof(float) * overlap);
+    }
+}
+
+static void build_biquads(const DspConfig* config)
+{
+    // Any more and the cascade would cost more than the FFT anyway
+    n_biquads = MIN(config->n_frequency_ranges, MAX_BIQUADS);
+    for (int i = 0; i < n_biquads; ++i)
+        biquads[i] = design_biquad(&config->frequency_ranges[i]);
+
+    // Coefficients may have changed drastically, so don't let old state ring
+    memset(biquad_state, 0, sizeof(biquad_state));
+    biquads_version = config->version;
+}
 
-    // Retrieve processed samples
-    FILL output_buffer[i * 2 + 0] = left_ifft[PACKET_SIZE + i] / (float)PACKET_SIZE / 3.0f;
-    FILL output_buffer[i * 2 + 1] = right_ifft[PACKET_SIZE + i] / (float)PACKET_SIZE / 3.0f;
-    return output_buffer;
+static Biquad design_biquad(const FrequencyRange* range)
+{
+    /*
+        From the RBJ "Audio EQ Cookbook". Ranges reaching either end of the
+        spectrum become shelves (or high/low-pass filters if effectively muted),
+        and anything else becomes a peaking filter spanning the range.
+    */
+
+    float nyquist = (float)AUDIO_FREQUENCY / 2.0f;
+    float min = CLAMP((float)range->minimum, 1.0f, nyquist * 0.98f);
+    float max = CLAMP((float)range->maximum, min + 1.0f, nyquist * 0.99f);
+    float gain = MAX((float)range->multiplier, MINIMUM_MULTIPLIER);
+    bool is_muted = range->multiplier < MUTED_MULTIPLIER;
+    bool reaches_bottom = range->minimum <= SHELF_LOWER_FREQUENCY;
+    bool reaches_top = range->maximum >= SHELF_UPPER_FREQUENCY;
+
+    Biquad biquad = { 0 };
+
+    // Covers everything; just a change in volume
+    if (reaches_bottom && reaches_top)
+    {
+        biquad.b0 = range->multiplier;
+        return biquad;
+    }
+
+    float frequency = reaches_bottom ? max : (reaches_top ? min : sqrtf(min * max));
+    float w0 = 2.0f * G_PI * frequency / (float)AUDIO_FREQUENCY;
+    float cos_w0 = cosf(w0);
+    float sin_w0 = sinf(w0);
+    float A = sqrtf(gain);
+    float b0, b1, b2, a0, a1, a2;
+
+    if ((reaches_bottom || reaches_top) && is_muted)
+    {
+        // Butterworth (Q = 1/√2) high-pass to remove the bottom, or low-pass
+        // to remove the top
+        float alpha = sin_w0 / G_SQRT2;
+        float sign = reaches_bottom ? 1.0f : -1.0f;
+        b0 = (1.0f + sign * cos_w0) / 2.0f;
+        b1 = -sign * (1.0f + sign * cos_w0);
+        b2 = b0;
+        a0 = 1.0f + alpha;
+        a1 = -2.0f * cos_w0;
+        a2 = 1.0f - alpha;
+    }
+    else if (reaches_bottom || reaches_top)
+    {
+        // Shelf with a slope of 1
+        float alpha = sin_w0 / G_SQRT2;
+        float beta = 2.0f * sqrtf(A) * alpha;
+        float sign = reaches_bottom ? 1.0f : -1.0f;
+        b0 = A * ((A + 1.0f) - sign * (A - 1.0f) * cos_w0 + beta);
+        b1 = sign * 2.0f * A * ((A - 1.0f) - sign * (A + 1.0f) * cos_w0);
+        b2 = A * ((A + 1.0f) - sign * (A - 1.0f) * cos_w0 - beta);
+        a0 = (A + 1.0f) + sign * (A - 1.0f) * cos_w0 + beta;
+        a1 = -sign * 2.0f * ((A - 1.0f) + sign * (A + 1.0f) * cos_w0);
+        a2 = (A + 1.0f) + sign * (A - 1.0f) * cos_w0 - beta;
+    }
+    else
+    {
+        // Peaking, with the bandwidth in octaves
+        float bandwidth = log2f(max / min);
+        float alpha = sin_w0 * sinhf(logf(2.0f) / 2.0f * bandwidth * w0 / sin_w0);
+        b0 = 1.0f + alpha * A;
+        b1 = -2.0f * cos_w0;
+        b2 = 1.0f - alpha * A;
+        a0 = 1.0f + alpha / A;
+        a1 = -2.0f * cos_w0;
+        a2 = 1.0f - alpha / A;
+    }
+
+    biquad.b0 = b0 / a0;
+    biquad.b1 = b1 / a0;
+    biquad.b2 = b2 / a0;
+    biquad.a1 = a1 / a0;
+    biquad.a2 = a2 / a0;
+    return biquad;
+}
+
+static void process_iir_packet(AudioPacket* packet)
+{
+    int n_samples = packet->length / CHANNELS;
+
+    for (int start = 0; start < n_samples; start += IIR_BLOCK_SIZE)
+    {
+        int count = MIN(n_samples - start, IIR_BLOCK_SIZE);
+        float* data = packet->data + start * CHANNELS;
+
+        for (int g = 0; g < IIR_GROUPS; ++g)
+        {
+            int first_channel = g * IIR_LANES;
+            int n_lanes = MIN(CHANNELS - first_channel, IIR_LANES);
+
+            // Gather this group's channels into lanes
+            for (int i = 0; i < count; ++i)
+            {
+                LaneVector samples = { 0 };
+                for (int l = 0; l < n_lanes; ++l)
+                    samples[l] = data[i * CHANNELS + first_channel + l];
+                iir_block[i] = samples;
+            }
+
+            for (int b = 0; b < n_biquads; ++b)
+                run_biquad(&biquads[b], biquad_state[g][b], count);
+
+            for (int i = 0; i < count; ++i)
+                for (int l = 0; l < n_lanes; ++l)
+                    data[i * CHANNELS + first_channel + l] = iir_block[i][l];
+        }
+    }
 }
 
-static void modify_frequency_range(float min, float max, float multiplier)
+static void run_biquad(const Biquad* biquad, LaneVector* state, int n_samples)
 {
+    // Transposed direct form II
+    LaneVector z1 = state[0];
+    LaneVector z2 = state[1];
+
+    for (int i = 0; i < n_samples; ++i)
+    {
+        LaneVector x = iir_block[i];
+        LaneVector y = biquad->b0 * x + z1;
+        z1 = biquad->b1 * x - biquad->a1 * y + z2;
+        z2 = biquad->b2 * x - biquad->a2 * y;
+        iir_block[i] = y;
+    }
+
+    // Flush denormals as the tail decays, as they are very slow on x86
+    const float tiny = 1e-18f;
+    state[0] = (z1 + tiny) - tiny;
+    state[1] = (z2 + tiny) - tiny;
+}
+
+Convolver* convolver_new(const char* path)
+{
+    // Converted to the device's format (and sample rate) for us
+    Mix_Chunk* chunk = Mix_LoadWAV(path);
+    if (chunk == NULL)
+    {
+        g_warning("failed to load impulse response %s: %s", path, Mix_GetError());
+        return NULL;
+    }
+
+    const float* samples = (const float*)chunk->abuf;
+    int n_samples = chunk->alen / (sizeof(float) * CHANNELS);
+    n_samples = MIN(n_samples, AUDIO_FREQUENCY * MAX_IMPULSE_RESPONSE_SECONDS);
+
     /*
-        Work out bins.
+        Normalise to unit energy, so that the overall loudness stays about the
+        same whatever the recording's level and length (and loud ones don't
+        clip). The louder channel sets the gain, to keep the balance between
+        them.
+    */
+    double max_energy = 0.0;
+    for (int c = 0; c < CHANNELS; ++c)
+    {
+        double energy = 0.0;
+        for (int i = 0; i < n_samples; ++i)
+            energy += (double)samples[i * CHANNELS + c] * samples[i * CHANNELS + c];
+        max_energy = MAX(max_energy, energy);
+    }
+
+    if (n_samples == 0 || max_energy == 0.0)
+    {
+        g_warning("impulse response %s is empty", path);
+        Mix_FreeChunk(chunk);
+        return NULL;
+    }
 
-        Because of the finite bin size, the lower bin may not be 0, even if the
-        frequency is. Likewise, the upper bin may not be the maximum it can be
-        even if the upper frequency is 20,000 Hz!
+    Convolver* convolver = malloc(sizeof(Convolver));
+    convolver->references = 1;
+    convolver->id = (unsigned int)g_atomic_int_add(&next_convolver_id, 1);
+    convolver->n_partitions = (n_samples + CONVOLUTION_BLOCK_SIZE - 1) / CONVOLUTION_BLOCK_SIZE;
 
-        Adding a bit of leeway helps fix this for when the lower frequency is
-        0 Hz, for example.
+    size_t spectra_size = (size_t)convolver->n_partitions * CHANNELS * CONVOLUTION_BINS;
+    convolver->impulse_spectra = fftwf_alloc_complex(spectra_size);
+
+    /*
+        Transform each partition, zero-padded to twice its length. Executing
+        the existing plan on our own arrays is thread-safe, unlike planning.
+        The round trip's scaling is folded in here too.
     */
+    float* frames = fftwf_alloc_real(CONVOLUTION_FFT_SIZE * CHANNELS);
+    float scale = (float)(1.0 / (CONVOLUTION_FFT_SIZE * sqrt(max_energy)));
 
-    float frequency_resolution = (float)AUDIO_FREQUENCY / (float)(PACKET_SIZE * 3);
-    int lower_bin = (int)(min / frequency_resolution);
-    int upper_bin = (int)(max / frequency_resolution);
-    lower_bin = MAX(lower_bin - 1, 0);
-    upper_bin = MIN(upper_bin + 1, PACKET_SIZE * 3 - 1);
+    for (int p = 0; p < convolver->n_partitions; ++p)
+    {
+        memset(frames, 0, sizeof(float) * CONVOLUTION_FFT_SIZE * CHANNELS);
+
+        int start = p * CONVOLUTION_BLOCK_SIZE;
+        int count = MIN(n_samples - start, CONVOLUTION_BLOCK_SIZE);
+        for (int c = 0; c < CHANNELS; ++c)
+            for (int i = 0; i < count; ++i)
+                frames[c * CONVOLUTION_FFT_SIZE + i] = samples[(start + i) * CHANNELS + c] * scale;
+
+        fftwf_execute_dft_r2c(
+            convolution_forward_plan,
+            frames,
+            convolver->impulse_spectra + (size_t)p * CHANNELS * CONVOLUTION_BINS
+        );
+    }
+
+    fftwf_free(frames);
+    Mix_FreeChunk(chunk);
+    return convolver;
+}
 
-    for (int i = lower_bin; i <= upper_bin; ++i)
+Convolver* convolver_ref(Convolver* convolver)
+{
+    convolver->references++;
+    return convolver;
+}
+
+void convolver_unref(Convolver* convolver)
+{
+    if (convolver == NULL || --convolver->references > 0)
+        return;
+
+    fftwf_free(convolver->impulse_spectra);
+    free(convolver);
+}
+
+void convolver_process_packet(const Convolver* convolver, AudioPacket* packet)
+{
+    if (convolver->id != convolver_id)
+        reset_convolution(convolver);
+
+    int n_samples = packet->length / CHANNELS;
+    int position = 0;
+
+    while (position < n_samples)
+    {
+        int block_position = convolution_block_position;
+        int count = MIN(n_samples - position, CONVOLUTION_BLOCK_SIZE - block_position);
+        float* samples = packet->data + position * CHANNELS;
+
+        // New samples go into the second half of each channel's input
+        float* inputs[CHANNELS];
+        const float* outputs[CHANNELS];
+        for (int c = 0; c < CHANNELS; ++c)
+        {
+            inputs[c] = convolution_input + c * CONVOLUTION_FFT_SIZE + CONVOLUTION_BLOCK_SIZE + block_position;
+            outputs[c] = convolution_output_ready[c] + block_position;
+        }
+
+        // Swap incoming samples for ones processed a block ago
+        simd_deinterleave(samples, inputs, CHANNELS, count);
+        simd_interleave(outputs, samples, CHANNELS, count);
+
+        position += count;
+        convolution_block_position += count;
+
+        // Keep pace with the block filling up, so it's all done by the time it's full
+        int n_later_partitions = convolver->n_partitions - 1;
+        accumulate_partitions(
+            convolver,
+            1 + n_later_partitions * convolution_block_position / CONVOLUTION_BLOCK_SIZE
+        );
+
+        if (convolution_block_position == CONVOLUTION_BLOCK_SIZE)
+        {
+            process_convolution_block(convolver);
+            convolution_block_position = 0;
+        }
+    }
+}
+
+static void reset_convolution(const Convolver* convolver)
+{
+    // The delay line isn't cleared; stale slots are skipped until overwritten
+    convolver_id = convolver->id;
+    delay_line_position = 0;
+    n_blocks_seen = 0;
+    n_partitions_done = 1;
+    convolution_block_position = 0;
+
+    memset(convolution_spectra, 0, sizeof(fftwf_complex) * CHANNELS * CONVOLUTION_BINS);
+    memset(convolution_input, 0, sizeof(float) * CONVOLUTION_FFT_SIZE * CHANNELS);
+    for (int c = 0; c < CHANNELS; ++c)
+        memset(convolution_output_ready[c], 0, sizeof(float) * CONVOLUTION_BLOCK_SIZE);
+}
+
+/*
+    Multiply-accumulate a partition of the impulse response with the input
+    from that many blocks ago. Done on the raw floats so as to avoid C's (slow,
+    NaN-aware) complex multiplication.
+*/
+static void multiply_accumulate(const fftwf_complex* input, const fftwf_complex* impulse)
+{
+    size_t partition_size = CHANNELS * CONVOLUTION_BINS;
+    float* accumulator = (float*)convolution_spectra;
+    const float* x = (const float*)input;
+    const float* h = (const float*)impulse;
+
+    for (size_t i = 0; i < partition_size; ++i)
     {
-        left_fft[i] = modify_magnitude(left_fft[i], multiplier);
-        right_fft[i] = modify_magnitude(right_fft[i], multiplier);
+        float xr = x[i * 2], xi = x[i * 2 + 1];
+        float hr = h[i * 2], hi = h[i * 2 + 1];
+        accumulator[i * 2] += xr * hr - xi * hi;
+        accumulator[i * 2 + 1] += xr * hi + xi * hr;
     }
 }
 
-static float complex modify_magnitude(float complex c, float multiplier)
+// Sums partitions [1, up_to) into the next block's output, which only needs past input
+static void accumulate_partitions(const Convolver* convolver, int up_to)
 {
-    // Convert to polar form
-    float magnitude = cabsf(c);
-    float phase = cargf(c);
-    magnitude *= multiplier;
+    size_t partition_size = CHANNELS * CONVOLUTION_BINS;
+
+    // Anything further back than the last reset would be silence
+    up_to = MIN(up_to, MIN(convolver->n_partitions, n_blocks_seen + 1));
+
+    for (int p = n_partitions_done; p < up_to; ++p)
+    {
+        int slot = (delay_line_position - p + convolver->n_partitions) % convolver->n_partitions;
+        multiply_accumulate(
+            delay_line + slot * partition_size,
+            convolver->impulse_spectra + p * partition_size
+        );
+    }
+
+    n_partitions_done = MAX(n_partitions_done, up_to);
+}
+
+static void process_convolution_block(const Convolver* convolver)
+{
+    size_t partition_size = CHANNELS * CONVOLUTION_BINS;
+
+    // Transform the latest two blocks into the front of the delay line
+    fftwf_complex* latest = delay_line + delay_line_position * partition_size;
+    fftwf_execute_dft_r2c(convolution_forward_plan, convolution_input, latest);
 
-    // Convert back to Cartesian form
-    c = magnitude * cosf(phase) + I * magnitude * sinf(phase);
-    return c;
+    // The later partitions are already in, so only the first is left
+    multiply_accumulate(latest, convolver->impulse_spectra);
+
+    // Only the second half is free of circular wrap-around
+    fftwf_execute_dft_c2r(convolution_inverse_plan, convolution_spectra, convolution_frames);
+
+    for (int c = 0; c < CHANNELS; ++c)
+    {
+        float* channel_input = convolution_input + c * CONVOLUTION_FFT_SIZE;
+        memcpy(
+            convolution_output_ready[c],
+            convolution_frames + c * CONVOLUTION_FFT_SIZE + CONVOLUTION_BLOCK_SIZE,
+            sizeof(float) * CONVOLUTION_BLOCK_SIZE
+        );
+        memcpy(channel_input, channel_input + CONVOLUTION_BLOCK_SIZE, sizeof(float) * CONVOLUTION_BLOCK_SIZE);
+    }
+
+    // Start on the next block's output
+    delay_line_position = (delay_line_position + 1) % convolver->n_partitions;
+    n_blocks_seen = MIN(n_blocks_seen + 1, convolver->n_partitions);
+    n_partitions_done = 1;
+    memset(convolution_spectra, 0, sizeof(fftwf_complex) * partition_size);
 }
 
 void equaliser_destroy()
 {
-    if (previous_packets[0] != NULL) free(previous_packets[0]);
-    if (previous_packets[1] != NULL) free(previous_packets[1]);
+    for (int i = 0; i < N_LATENCIES; ++i)
+    {
+        fftwf_destroy_plan(forward_plans[i]);
+        fftwf_destroy_plan(inverse_plans[i]);
+    }
+
+    for (int c = 0; c < CHANNELS; ++c)
+    {
+        free(input_history[c]);
+        free(output_overlap[c]);
+        free(output_ready[c]);
+    }
+
+    free(window);
+    free(gain_mask);
+    fftwf_free(frames);
+    fftwf_free(spectra);
+
+    fftwf_destroy_plan(convolution_forward_plan);
+    fftwf_destroy_plan(convolution_inverse_plan);
+    fftwf_free(convolution_frames);
+    fftwf_free(convolution_spectra);
 
-    free(samples_buffer);
-    fftwf_free(left_fft);
-    fftwf_free(right_fft);
-    fftwf_free(left_ifft);
-    fftwf_free(right_ifft);
-    free(output_buffer);
+    fftwf_free(delay_line);
+    fftwf_free(convolution_input);
+    for (int c = 0; c < CHANNELS; ++c)
+        free(convolution_output_ready[c]);
 }
@@ -4,6 +4,9 @@
 #include "playback.h"
 #include "preferences.h"
 #include "audio_stream.h"
+#include "wisdom.h"
+#include "metadata_cache.h"
+#include "visualiser.h"
 #include "dbus.h"
 
 static void on_close(GtkWidget* app);
@@ -24,8 +27,18 @@ static const GActionEntry app_actions[] =
 
 // Command line arguments
 static gchar** input_filenames = NULL;
+static gboolean benchmark_visualiser = FALSE;
 static GOptionEntry option_entries[] =
 {
+    {
+        "benchmark-visualiser",
+        0,
+        0,
+        G_OPTION_ARG_NONE,
+        &benchmark_visualiser,
+        "Time the visualiser's renderers and exit",
+        NULL
+    },
     {
         G_OPTION_REMAINING,
         0,
@@ -38,12 +51,20 @@ static GOptionEntry option_entries[] =
     { NULL }
 };
 
-static void on_activate(GtkApplication* app)
+static void init_fftw()
 {
-    // homebrew's fftw doesn't seem to include fftwf
-#ifndef __APPLE__
+    // Not every build of fftwf comes with threads (homebrew's doesn't)
+#ifdef HAVE_FFTW_THREADS
+    fftwf_init_threads();
     fftwf_make_planner_thread_safe();
 #endif
+}
+
+static void on_activate(GtkApplication* app)
+{
+    init_fftw();
+    wisdom_load();
+    init_metadata_cache();
 
     init_preferences();
     init_audio();
@@ -139,10 +160,12 @@ static void on_close(GtkWidget*)
 {
     Mix_CloseAudio();
     close_dbus();
+    wisdom_save();
 
     // Destroy UI
     destroy_playlist_ui();
     destroy_playback_ui();
+    free_metadata_cache();
     free_preferences();
 }
 
@@ -194,6 +217,17 @@ int main(int argc, char** argv)
         exit(1);
     }
 
+    // 4K wide; the visualiser picks the settings itself, for a fair comparison
+    if (benchmark_visualiser)
+    {
+        gtk_init();
+        init_fftw();
+        init_preferences();
+        visualiser_benchmark(3840, 1080, 500);
+        free_preferences();
+        return 0;
+    }
+
     g_autoptr(AdwApplication) app = NULL;
     app = adw_application_new("com.github.lukawarren.waveform", G_APPLICATION_DEFAULT_FLAGS);
     g_signal_connect(app, "activate", G_CALLBACK(on_activate), NULL);
@@ -0,0 +1,259 @@
+#include "metadata_cache.h"
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+// Bump the version whenever the layout of Record changes
+#define CACHE_MAGIC 0x444d5657
+#define CACHE_VERSION 1
+
+// Superseded records are only cleared out once they outweigh the live ones
+#define MIN_COMPACT_BYTES (64 * 1024)
+
+typedef struct CacheHeader
+{
+    guint32 magic;
+    guint32 version;
+} CacheHeader;
+
+typedef struct Record
+{
+    guint32 length;      // Padded so that the next record is aligned
+    guint32 path_length; // Each string includes its terminator
+    guint32 title_length;
+    guint32 artist_length;
+    gint64 size;
+    gint64 modified;
+    double duration;
+    gint32 sample_rate;
+    gint32 codec;
+    // Followed by the path, title and artist
+} Record;
+
+/*
+    Records are never modified once written; a newer one for the same path
+    simply replaces the old one in the index (and in the file, the next time
+    it's compacted). Those read at start-up point straight into the map, so
+    opening the cache costs nothing per track beyond a hash table insert.
+*/
+static GMutex mutex;
+static GMappedFile* mapped_file = NULL;
+static GHashTable* records = NULL; // Path to its newest record
+static GPtrArray* appended = NULL; // Records written since start-up
+static FILE* cache_file = NULL;
+
+static gchar* get_cache_path()
+{
+    return g_build_filename(g_get_user_cache_dir(), "waveform", "metadata", NULL);
+}
+
+static const gchar* get_record_path(const Record* record)
+{
+    return (const gchar*)(record + 1);
+}
+
+static const gchar* get_record_title(const Record* record)
+{
+    return get_record_path(record) + record->path_length;
+}
+
+static const gchar* get_record_artist(const Record* record)
+{
+    return get_record_title(record) + record->title_length;
+}
+
+static bool is_valid_record(const Record* record, gsize available)
+{
+    if (available < sizeof(Record) ||
+        record->length > available ||
+        record->length % sizeof(gint64) != 0 ||
+        record->path_length == 0 || record->path_length > record->length ||
+        record->title_length == 0 || record->title_length > record->length ||
+        record->artist_length == 0 || record->artist_length > record->length)
+        return false;
+
+    gsize strings = (gsize)record->path_length + record->title_length + record->artist_length;
+    if (sizeof(Record) + strings > record->length)
+        return false;
+
+    // Anything torn by a crash mid-write won't be terminated where it says
+    return get_record_path(record)[record->path_length - 1] == '\0' &&
+        get_record_title(record)[record->title_length - 1] == '\0' &&
+        get_record_artist(record)[record->artist_length - 1] == '\0';
+}
+
+// Returns where the last whole record ends
+static gsize index_records(const gchar* contents, gsize length, gsize* live_bytes)
+{
+    gsize offset = sizeof(CacheHeader);
+    while (offset < length)
+    {
+        const Record* record = (const Record*)(contents + offset);
+        if (!is_valid_record(record, length - offset))
+            break;
+
+        const Record* previous = g_hash_table_lookup(records, get_record_path(record));
+        if (previous != NULL)
+            *live_bytes -= previous->length;
+        *live_bytes += record->length;
+
+        g_hash_table_replace(records, (gpointer)get_record_path(record), (gpointer)record);
+        offset += record->length;
+    }
+    return offset;
+}
+
+static void rewrite_cache(const char* path)
+{
+    GByteArray* contents = g_byte_array_new();
+    CacheHeader header = { CACHE_MAGIC, CACHE_VERSION };
+    g_byte_array_append(contents, (const guint8*)&header, sizeof(header));
+
+    GHashTableIter iter;
+    gpointer record;
+    g_hash_table_iter_init(&iter, records);
+    while (g_hash_table_iter_next(&iter, NULL, &record))
+        g_byte_array_append(contents, record, ((const Record*)record)->length);
+
+    // Replaced by a rename, so the old map (and so the index) stays valid
+    gchar* directory = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(directory, 0755) != 0 ||
+        !g_file_set_contents(path, (const gchar*)contents->data, contents->len, NULL))
+        g_warning("failed to save metadata cache to %s", path);
+
+    g_free(directory);
+    g_byte_array_unref(contents);
+}
+
+void init_metadata_cache()
+{
+    records = g_hash_table_new(g_str_hash, g_str_equal);
+    appended = g_ptr_array_new_with_free_func(g_free);
+
+    gchar* path = get_cache_path();
+    gsize length = 0;
+    gsize end = 0;
+    gsize live_bytes = 0;
+
+    // Not finding one is fine; it just means everything gets probed
+    mapped_file = g_mapped_file_new(path, FALSE, NULL);
+    if (mapped_file != NULL)
+    {
+        const gchar* contents = g_mapped_file_get_contents(mapped_file);
+        length = g_mapped_file_get_length(mapped_file);
+
+        const CacheHeader* header = (const CacheHeader*)contents;
+        if (length >= sizeof(CacheHeader) &&
+            header->magic == CACHE_MAGIC &&
+            header->version == CACHE_VERSION)
+            end = index_records(contents, length, &live_bytes);
+    }
+
+    // Start afresh if it's missing, from an older version, torn or mostly dead
+    if (end == 0 || end != length ||
+        (length > MIN_COMPACT_BYTES && live_bytes < (length - sizeof(CacheHeader)) / 2))
+        rewrite_cache(path);
+
+    cache_file = g_fopen(path, "ab");
+    if (cache_file == NULL)
+        g_warning("failed to open metadata cache %s", path);
+
+    g_free(path);
+}
+
+void free_metadata_cache()
+{
+    g_mutex_lock(&mutex);
+
+    if (cache_file != NULL)
+        fclose(cache_file);
+    cache_file = NULL;
+
+    g_clear_pointer(&records, g_hash_table_unref);
+    g_clear_pointer(&appended, g_ptr_array_unref);
+    g_clear_pointer(&mapped_file, g_mapped_file_unref);
+
+    g_mutex_unlock(&mutex);
+}
+
+bool metadata_cache_lookup(const char* path, TrackMetadata* metadata)
+{
+    g_mutex_lock(&mutex);
+    const Record* record = records != NULL ? g_hash_table_lookup(records, path) : NULL;
+    g_mutex_unlock(&mutex);
+
+    if (record == NULL)
+        return false;
+
+    metadata->title = get_record_title(record);
+    metadata->artist = get_record_artist(record);
+    metadata->duration = record->duration;
+    metadata->sample_rate = record->sample_rate;
+    metadata->codec = record->codec;
+    metadata->size = record->size;
+    metadata->modified = record->modified;
+    return true;
+}
+
+bool metadata_cache_stamp(const char* path, TrackMetadata* metadata)
+{
+    GStatBuf info;
+    if (g_stat(path, &info) != 0)
+        return false;
+
+    metadata->size = (gint64)info.st_size;
+    metadata->modified = (gint64)info.st_mtime;
+    return true;
+}
+
+bool metadata_cache_is_current(const TrackMetadata* cached, const TrackMetadata* stamp)
+{
+    // Changing the file in any way means it has to be read again
+    return cached->size == stamp->size && cached->modified == stamp->modified;
+}
+
+void metadata_cache_store(const char* path, const TrackMetadata* metadata)
+{
+    gsize path_length = strlen(path) + 1;
+    gsize title_length = strlen(metadata->title) + 1;
+    gsize artist_length = strlen(metadata->artist) + 1;
+    gsize length = sizeof(Record) + path_length + title_length + artist_length;
+    length = (length + sizeof(gint64) - 1) & ~(sizeof(gint64) - 1);
+
+    Record* record = g_malloc0(length);
+    record->length = (guint32)length;
+    record->path_length = (guint32)path_length;
+    record->title_length = (guint32)title_length;
+    record->artist_length = (guint32)artist_length;
+    record->size = metadata->size;
+    record->modified = metadata->modified;
+    record->duration = metadata->duration;
+    record->sample_rate = metadata->sample_rate;
+    record->codec = metadata->codec;
+    memcpy((gchar*)get_record_path(record), path, path_length);
+    memcpy((gchar*)get_record_title(record), metadata->title, title_length);
+    memcpy((gchar*)get_record_artist(record), metadata->artist, artist_length);
+
+    g_mutex_lock(&mutex);
+
+    if (records == NULL)
+    {
+        g_mutex_unlock(&mutex);
+        g_free(record);
+        return;
+    }
+
+    g_hash_table_replace(records, (gpointer)get_record_path(record), record);
+    g_ptr_array_add(appended, record);
+
+    // A partial write is caught at the next start-up, but don't add to it
+    if (cache_file != NULL &&
+        (fwrite(record, length, 1, cache_file) != 1 || fflush(cache_file) != 0))
+    {
+        g_warning("failed to append to metadata cache");
+        fclose(cache_file);
+        cache_file = NULL;
+    }
+
+    g_mutex_unlock(&mutex);
+}
@@ -0,0 +1,286 @@
+#include "overview.h"
+#include "simd.h"
+#include "common.h"
+#include <SDL_mixer.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+// Frames decoded (and summarised) at a time; the finest detail ever kept
+#define CHUNK_FRAMES 1024
+
+// Bump the version whenever the layout of Overview changes
+#define CACHE_MAGIC 0x564f5657
+#define CACHE_VERSION 1
+
+// About 5000 tracks' worth; past that the least recently used are dropped,
+// down to a little under so that it isn't pruned again on the very next save
+#define MAX_CACHE_BYTES (64 * 1024 * 1024)
+#define PRUNED_CACHE_BYTES (MAX_CACHE_BYTES / 4 * 3)
+
+typedef struct CacheHeader
+{
+    guint32 magic;
+    guint32 version;
+    guint32 n_buckets;
+    guint32 reserved;
+} CacheHeader;
+
+typedef struct CacheEntry
+{
+    gchar* path;
+    gint64 accessed;
+    gint64 size;
+} CacheEntry;
+
+typedef struct Chunk
+{
+    float minimum;
+    float maximum;
+    float sum_squares;
+    int n_samples;
+} Chunk;
+
+static GCancellable* cancellable = NULL;
+static OverviewCallback overview_callback = NULL;
+
+static gchar* get_cache_path(const char* path)
+{
+    // Changing the file in any way should invalidate its overview
+    GStatBuf info;
+    if (g_stat(path, &info) != 0)
+        return NULL;
+
+    gchar* key = g_strdup_printf(
+        "%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT,
+        path,
+        (gint64)info.st_size,
+        (gint64)info.st_mtime
+    );
+    gchar* hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+    gchar* cache_path = g_build_filename(g_get_user_cache_dir(), "waveform", "overviews", hash, NULL);
+
+    g_free(hash);
+    g_free(key);
+    return cache_path;
+}
+
+static Overview* load_cached_overview(const char* cache_path)
+{
+    gchar* contents;
+    gsize length;
+    if (!g_file_get_contents(cache_path, &contents, &length, NULL))
+        return NULL;
+
+    // Anything unexpected is treated as a miss and simply overwritten later
+    Overview* overview = NULL;
+    const CacheHeader* header = (const CacheHeader*)contents;
+    if (length == sizeof(CacheHeader) + sizeof(Overview) &&
+        header->magic == CACHE_MAGIC &&
+        header->version == CACHE_VERSION &&
+        header->n_buckets == OVERVIEW_BUCKETS)
+    {
+        overview = g_new(Overview, 1);
+        memcpy(overview, contents + sizeof(CacheHeader), sizeof(Overview));
+    }
+
+    g_free(contents);
+    return overview;
+}
+
+static gint compare_cache_entries(gconstpointer a, gconstpointer b)
+{
+    gint64 accessed_a = ((const CacheEntry*)a)->accessed;
+    gint64 accessed_b = ((const CacheEntry*)b)->accessed;
+    return (accessed_a > accessed_b) - (accessed_a < accessed_b);
+}
+
+static void clear_cache_entry(gpointer entry)
+{
+    g_free(((CacheEntry*)entry)->path);
+}
+
+static void prune_overview_cache(const char* directory)
+{
+    GDir* dir = g_dir_open(directory, 0, NULL);
+    if (dir == NULL)
+        return;
+
+    GArray* entries = g_array_new(FALSE, FALSE, sizeof(CacheEntry));
+    g_array_set_clear_func(entries, clear_cache_entry);
+    gint64 total = 0;
+
+    const gchar* name;
+    while ((name = g_dir_read_name(dir)) != NULL)
+    {
+        gchar* path = g_build_filename(directory, name, NULL);
+        GStatBuf info;
+        if (g_stat(path, &info) != 0)
+        {
+            g_free(path);
+            continue;
+        }
+
+        /*
+            Reading an overview back in updates its access time, albeit only
+            daily on relatime mounts, which is plenty to tell the tracks that
+            are still being played from those that have long since gone.
+        */
+        CacheEntry entry = { path, MAX((gint64)info.st_atime, (gint64)info.st_mtime), (gint64)info.st_size };
+        g_array_append_val(entries, entry);
+        total += entry.size;
+    }
+    g_dir_close(dir);
+
+    if (total > MAX_CACHE_BYTES)
+    {
+        g_array_sort(entries, compare_cache_entries);
+        for (guint i = 0; i < entries->len && total > PRUNED_CACHE_BYTES; ++i)
+        {
+            const CacheEntry* entry = &g_array_index(entries, CacheEntry, i);
+            if (g_remove(entry->path) == 0)
+                total -= entry->size;
+        }
+    }
+
+    g_array_unref(entries);
+}
+
+static void save_overview(const Overview* overview, const char* cache_path)
+{
+    gsize length = sizeof(CacheHeader) + sizeof(Overview);
+    gchar* contents = g_malloc(length);
+    CacheHeader header = { CACHE_MAGIC, CACHE_VERSION, OVERVIEW_BUCKETS, 0 };
+    memcpy(contents, &header, sizeof(header));
+    memcpy(contents + sizeof(header), overview, sizeof(Overview));
+
+    gchar* directory = g_path_get_dirname(cache_path);
+    if (g_mkdir_with_parents(directory, 0755) != 0 ||
+        !g_file_set_contents(cache_path, contents, length, NULL))
+        g_warning("failed to save overview to %s", cache_path);
+    else
+        prune_overview_cache(directory);
+
+    g_free(directory);
+    g_free(contents);
+}
+
+static Overview* decode_overview(const char* path, GCancellable* cancellable)
+{
+    // A separate instance, so playback is never disturbed
+    Mix_Music* music = Mix_LoadMUS(path);
+    if (music == NULL)
+    {
+        g_warning("failed to decode %s for its overview", path);
+        return NULL;
+    }
+
+    /*
+        The duration isn't known up front for every format, so summarise fixed
+        chunks as they're decoded and only divide them into buckets at the end.
+        Even an hour-long track only needs a couple of megabytes for this.
+    */
+    GArray* chunks = g_array_new(FALSE, FALSE, sizeof(Chunk));
+    float samples[CHUNK_FRAMES * CHANNELS];
+    int bytes;
+
+    while (!g_cancellable_is_cancelled(cancellable) &&
+           (bytes = Mix_DecodeMusic(music, samples, sizeof(samples))) > 0)
+    {
+        Chunk chunk = { FLT_MAX, -FLT_MAX, 0.0f, bytes / (int)sizeof(float) };
+        simd_reduce_envelope(samples, chunk.n_samples, &chunk.minimum, &chunk.maximum, &chunk.sum_squares);
+        g_array_append_val(chunks, chunk);
+
+        if (bytes < (int)sizeof(samples))
+            break;
+    }
+
+    Mix_FreeMusic(music);
+
+    if (g_cancellable_is_cancelled(cancellable) || chunks->len == 0)
+    {
+        g_array_free(chunks, TRUE);
+        return NULL;
+    }
+
+    Overview* overview = g_new(Overview, 1);
+    for (guint b = 0; b < OVERVIEW_BUCKETS; ++b)
+    {
+        // Short tracks have fewer chunks than buckets, so some get shared
+        guint first = (guint)((guint64)b * chunks->len / OVERVIEW_BUCKETS);
+        guint last = (guint)((guint64)(b + 1) * chunks->len / OVERVIEW_BUCKETS);
+        last = MAX(last, first + 1);
+
+        float minimum = FLT_MAX;
+        float maximum = -FLT_MAX;
+        double sum_squares = 0.0;
+        gint64 n_samples = 0;
+
+        for (guint c = first; c < last; ++c)
+        {
+            const Chunk* chunk = &g_array_index(chunks, Chunk, c);
+            minimum = MIN(minimum, chunk->minimum);
+            maximum = MAX(maximum, chunk->maximum);
+            sum_squares += chunk->sum_squares;
+            n_samples += chunk->n_samples;
+        }
+
+        overview->minimum[b] = minimum;
+        overview->maximum[b] = maximum;
+        overview->rms[b] = (float)sqrt(sum_squares / (double)MAX(n_samples, 1));
+    }
+
+    g_array_free(chunks, TRUE);
+    return overview;
+}
+
+static void overview_thread(GTask* task, gpointer, gpointer task_data, GCancellable* cancellable)
+{
+    const char* path = task_data;
+    gchar* cache_path = get_cache_path(path);
+
+    Overview* overview = cache_path != NULL ? load_cached_overview(cache_path) : NULL;
+    if (overview == NULL)
+    {
+        overview = decode_overview(path, cancellable);
+        if (overview != NULL && cache_path != NULL)
+            save_overview(overview, cache_path);
+    }
+
+    g_free(cache_path);
+
+    if (overview != NULL)
+        g_task_return_pointer(task, overview, g_free);
+    else
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED, "no overview for %s", path);
+}
+
+static void on_overview_ready(GObject*, GAsyncResult* result, gpointer)
+{
+    // Cancelled tasks report an error here, even if they went on to finish
+    Overview* overview = g_task_propagate_pointer(G_TASK(result), NULL);
+    if (overview != NULL)
+        overview_callback(overview);
+}
+
+void overview_request(const char* path, OverviewCallback callback)
+{
+    overview_cancel();
+    overview_callback = callback;
+    cancellable = g_cancellable_new();
+
+    GTask* task = g_task_new(NULL, cancellable, on_overview_ready, NULL);
+    g_task_set_task_data(task, g_strdup(path), g_free);
+    g_task_run_in_thread(task, overview_thread);
+    g_object_unref(task);
+}
+
+void overview_cancel()
+{
+    if (cancellable != NULL)
+    {
+        g_cancellable_cancel(cancellable);
+        g_clear_object(&cancellable);
+    }
+}
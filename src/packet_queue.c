@@ -0,0 +1,64 @@
+#include "packet_queue.h"
+#include "common.h"
+#include <stdatomic.h>
+#include <string.h>
+
+_Static_assert(
+    (PACKET_QUEUE_LENGTH & (PACKET_QUEUE_LENGTH - 1)) == 0,
+    "packet queue length must be a power of two"
+);
+
+typedef struct PacketSlot
+{
+    AudioPacket packet;
+    float samples[PACKET_SIZE * CHANNELS];
+} PacketSlot;
+
+static PacketSlot slots[PACKET_QUEUE_LENGTH];
+
+/*
+    Both indices only ever increase (and are allowed to wrap), so the number of
+    packets in flight is simply their difference. The write index is owned by
+    the audio thread and the read index by the GTK thread.
+*/
+static atomic_uint write_index = 0;
+static atomic_uint read_index = 0;
+
+void packet_queue_push(const AudioPacket* packet)
+{
+    unsigned int write = atomic_load_explicit(&write_index, memory_order_relaxed);
+    unsigned int read = atomic_load_explicit(&read_index, memory_order_acquire);
+
+    // If the GTK thread has fallen behind, drop the packet rather than wait
+    if (write - read == PACKET_QUEUE_LENGTH)
+        return;
+
+    // Copy out of SDL's buffer, as it will be re-used for the next callback
+    PacketSlot* slot = &slots[write & (PACKET_QUEUE_LENGTH - 1)];
+    int capacity = (int)(sizeof(slot->samples) / sizeof(slot->samples[0]));
+    slot->packet = *packet;
+    slot->packet.data = slot->samples;
+    slot->packet.length = packet->length < capacity ? packet->length : capacity;
+    memcpy(slot->samples, packet->data, sizeof(float) * slot->packet.length);
+
+    // Publish
+    atomic_store_explicit(&write_index, write + 1, memory_order_release);
+}
+
+AudioPacket* packet_queue_peek()
+{
+    unsigned int read = atomic_load_explicit(&read_index, memory_order_relaxed);
+    unsigned int write = atomic_load_explicit(&write_index, memory_order_acquire);
+
+    if (read == write)
+        return NULL;
+
+    return &slots[read & (PACKET_QUEUE_LENGTH - 1)].packet;
+}
+
+void packet_queue_pop()
+{
+    // Hand the slot back to the audio thread
+    unsigned int read = atomic_load_explicit(&read_index, memory_order_relaxed);
+    atomic_store_explicit(&read_index, read + 1, memory_order_release);
+}
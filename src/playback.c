@@ -2,7 +2,11 @@
 #include "playlist.h"
 #include "playback.h"
 #include "visualiser.h"
+#include "preferences.h"
+#include "packet_queue.h"
+#include "overview.h"
 #include "common.h"
+#include <string.h>
 
 // UI
 static GtkWidget* stack;
@@ -12,6 +16,7 @@ static GtkWidget* backwards_button;
 static GtkWidget* play_button;
 static GtkWidget* forwards_button;
 static GtkWidget* playback_slider;
+static GtkWidget* overview_area;
 static GtkWidget* playback_bar;
 static GtkWidget* drawing_area;
 static GtkWidget* mute_button;
@@ -22,12 +27,52 @@ static PlaylistEntry* current_entry = NULL;
 static AudioStream* audio_stream = NULL;
 static bool shuffle = false;
 
+// Envelope of the current track, once the worker has finished with it
+static Overview* overview = NULL;
+
+// When the frame clock last ticked, in microseconds
+static gint64 last_tick_time = 0;
+
+// How often to keep up with the music when the frame clock has stopped
+#define HOUSEKEEPING_INTERVAL_MS 100
+
+// Both only run while there's music (or a fade) to keep up with, or 0
+static guint tick_id = 0;
+static guint housekeeping_id = 0;
+
+/*
+    Packets arrive well before they can be heard, as the device still has its
+    buffer to play out in front of each one. However deep that buffer is, the
+    ring is emptied on every tick and what's drained is held here instead,
+    until the audio clock says it's audible. The clock is anchored to one
+    packet and then runs off sample positions, since callbacks (and so their
+    timestamps) tend to come in bursts. Pausing or changing speed throws the
+    two out of step, at which point it's simply anchored again.
+*/
+#define AUDIO_CLOCK_TOLERANCE_US 50000
+
+static bool is_clock_anchored = false;
+static guint64 anchor_position;
+static gint64 anchor_time;
+static int anchor_rate;
+
+typedef struct HeldPacket
+{
+    AudioPacket packet;
+    float samples[PACKET_SIZE * CHANNELS];
+} HeldPacket;
+
+static GQueue held_packets = G_QUEUE_INIT;
+static GQueue spare_packets = G_QUEUE_INIT; // Re-used rather than freed
+
 static void destroy_audio_stream();
 static void remake_audio_stream();
+static void on_audio_stream_advanced(bool is_visible, gint64 now);
+static void update_frame_callbacks();
 
 static void update_stack()
 {
-    gint length = g_list_length(playlist);
+    guint length = playlist->len;
     adw_view_stack_set_visible_child(
         ADW_VIEW_STACK(stack),
         length == 0 ? empty_page : playback_page
@@ -36,15 +81,14 @@ static void update_stack()
 
 static void select_random_song()
 {
-    GList* current_list_entry = g_list_find(playlist, current_entry);
-    guint length = g_list_length(playlist);
+    guint length = playlist->len;
 
     while (true)
     {
-        GList* entry = g_list_nth(playlist, rand() % length);
-        if (entry != current_list_entry)
+        guint index = (guint)rand() % length;
+        if (index != current_entry->index)
         {
-            current_entry = (PlaylistEntry*)entry->data;
+            current_entry = (PlaylistEntry*)g_ptr_array_index(playlist, index);
             break;
         }
     }
@@ -52,7 +96,7 @@ static void select_random_song()
 
 static void on_forwards(GtkButton*)
 {
-    if (g_list_length(playlist) == 1)
+    if (playlist->len == 1)
     {
         set_audio_stream_progress(audio_stream, 0.0f);
         remake_audio_stream();
@@ -61,14 +105,9 @@ static void on_forwards(GtkButton*)
 
     if (!shuffle)
     {
-        GList* current_list_entry = g_list_find(playlist, current_entry);
-
         // Loop back if need be
-        if (current_list_entry->next == NULL)
-            current_entry = (PlaylistEntry*)playlist->data;
-
-        else
-            current_entry = (PlaylistEntry*)current_list_entry->next->data;
+        guint next = current_entry->index + 1;
+        current_entry = (PlaylistEntry*)g_ptr_array_index(playlist, next == playlist->len ? 0 : next);
     }
     else
         select_random_song();
@@ -78,7 +117,7 @@ static void on_forwards(GtkButton*)
 
 static void on_backwards(GtkButton*)
 {
-    if (g_list_length(playlist) == 1)
+    if (playlist->len == 1)
     {
         set_audio_stream_progress(audio_stream, 0.0f);
         remake_audio_stream();
@@ -87,14 +126,9 @@ static void on_backwards(GtkButton*)
 
     if (!shuffle)
     {
-        GList* current_list_entry = g_list_find(playlist, current_entry);
-
-        // Loop back if  need be
-        if (current_list_entry->prev == NULL)
-            current_entry = (PlaylistEntry*)g_list_last(playlist)->data;
-
-        else
-            current_entry = (PlaylistEntry*)current_list_entry->prev->data;
+        // Loop back if need be
+        guint index = current_entry->index;
+        current_entry = (PlaylistEntry*)g_ptr_array_index(playlist, index == 0 ? playlist->len - 1 : index - 1);
     }
     else
         select_random_song();
@@ -106,6 +140,8 @@ static void on_play(GtkButton*)
 {
     toggle_audio_stream(audio_stream);
     set_current_playlist_entry(current_entry, audio_stream->is_playing);
+    visualiser_set_paused(!audio_stream->is_playing);
+    update_frame_callbacks();
 
     if (audio_stream->is_playing)
         gtk_button_set_icon_name(GTK_BUTTON(play_button), "media-playback-pause");
@@ -137,16 +173,188 @@ static void on_shuffle(GtkToggleButton*)
     shuffle = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(shuffle_button));
 }
 
+static void on_overview_ready(Overview* new_overview)
+{
+    g_free(overview);
+    overview = new_overview;
+    gtk_widget_queue_draw(overview_area);
+}
+
+static void get_overview_column(int x, int width, float* minimum, float* maximum, float* rms)
+{
+    int first = x * OVERVIEW_BUCKETS / width;
+    int last = MAX((x + 1) * OVERVIEW_BUCKETS / width, first + 1);
+
+    // Always span the centre line, so silence still shows up
+    *minimum = 0.0f;
+    *maximum = 0.0f;
+    *rms = 0.0f;
+
+    for (int b = first; b < last; ++b)
+    {
+        *minimum = MIN(*minimum, overview->minimum[b]);
+        *maximum = MAX(*maximum, overview->maximum[b]);
+        *rms = MAX(*rms, overview->rms[b]);
+    }
+
+    *minimum = CLAMP(*minimum, -1.0f, 0.0f);
+    *maximum = CLAMP(*maximum, 0.0f, 1.0f);
+    *rms = MIN(*rms, 1.0f);
+}
+
+static void draw_overview(GtkDrawingArea*, cairo_t* cr, int width, int height, gpointer)
+{
+    if (overview == NULL)
+        return;
+
+    // Line up with the slider's trough rather than the whole widget
+    GdkRectangle trough;
+    gtk_range_get_range_rect(GTK_RANGE(playback_slider), &trough);
+    int left = trough.width > 0 ? trough.x : 0;
+    int span = trough.width > 0 ? MIN(trough.width, width - left) : width;
+    if (span <= 0)
+        return;
+
+    GdkRGBA colour;
+#if GTK_CHECK_VERSION(4, 10, 0)
+    gtk_widget_get_color(overview_area, &colour);
+#else
+    gtk_style_context_get_color(gtk_widget_get_style_context(overview_area), &colour);
+#endif
+
+    float middle = height / 2.0f;
+    float minimum, maximum, rms;
+
+    // Peaks faintly, then the (louder-looking) RMS on top
+    for (int x = 0; x < span; ++x)
+    {
+        get_overview_column(x, span, &minimum, &maximum, &rms);
+        cairo_rectangle(cr, left + x, middle - maximum * middle, 1.0, (maximum - minimum) * middle);
+    }
+    cairo_set_source_rgba(cr, colour.red, colour.green, colour.blue, colour.alpha * 0.15);
+    cairo_fill(cr);
+
+    for (int x = 0; x < span; ++x)
+    {
+        get_overview_column(x, span, &minimum, &maximum, &rms);
+        cairo_rectangle(cr, left + x, middle - rms * middle, 1.0, 2.0f * rms * middle);
+    }
+    cairo_set_source_rgba(cr, colour.red, colour.green, colour.blue, colour.alpha * 0.3);
+    cairo_fill(cr);
+}
+
+static bool is_visualiser_visible()
+{
+    if (!gtk_widget_get_mapped(drawing_area))
+        return false;
+
+    // Minimised, or otherwise known by the compositor to be out of sight
+    GdkSurface* surface = gtk_native_get_surface(gtk_widget_get_native(drawing_area));
+    if (surface == NULL || !GDK_IS_TOPLEVEL(surface))
+        return true;
+
+    GdkToplevelState state = gdk_toplevel_get_state(GDK_TOPLEVEL(surface));
+#if GTK_CHECK_VERSION(4, 12, 0)
+    return !(state & (GDK_TOPLEVEL_STATE_MINIMIZED | GDK_TOPLEVEL_STATE_SUSPENDED));
+#else
+    return !(state & GDK_TOPLEVEL_STATE_MINIMIZED);
+#endif
+}
+
+static bool is_music_playing()
+{
+    return audio_stream != NULL && audio_stream->is_playing;
+}
+
+static gboolean on_tick(GtkWidget*, GdkFrameClock* frame_clock, gpointer)
+{
+    gint64 frame_time = gdk_frame_clock_get_frame_time(frame_clock);
+    last_tick_time = g_get_monotonic_time();
+    bool is_visible = is_visualiser_visible();
+    on_audio_stream_advanced(is_visible, frame_time);
+
+    // Animations don't depend on any audio arriving, and run out of sight
+    // too so that a fade can't keep the frame clock going forever
+    bool is_animating = visualiser_animate(frame_time);
+    if (is_visible && is_animating)
+        gtk_widget_queue_draw(drawing_area);
+
+    // Nothing left to draw until playback resumes
+    if (!is_music_playing() && !is_animating)
+    {
+        tick_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_housekeeping_timer(gpointer)
+{
+    // The frame clock stops for hidden windows, but the music still has to
+    // move on (and the queue be emptied) without it
+    if (g_get_monotonic_time() - last_tick_time > HOUSEKEEPING_INTERVAL_MS * 1000)
+        on_audio_stream_advanced(false, g_get_monotonic_time());
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void update_frame_callbacks()
+{
+    // The audio thread cannot wake us up without allocating, so poll instead,
+    // once per frame the monitor can actually show. Also started for the
+    // fade out on pausing, after which it removes itself.
+    if (tick_id == 0)
+        tick_id = gtk_widget_add_tick_callback(drawing_area, on_tick, NULL, NULL);
+
+    if (is_music_playing() && housekeeping_id == 0)
+        housekeeping_id = g_timeout_add(HOUSEKEEPING_INTERVAL_MS, on_housekeeping_timer, NULL);
+    else if (!is_music_playing() && housekeeping_id != 0)
+        g_clear_handle_id(&housekeeping_id, g_source_remove);
+}
+
+static void create_visualiser_widget()
+{
+    // Carry any running tick callback over to the new widget
+    bool was_ticking = tick_id != 0;
+    if (was_ticking)
+    {
+        gtk_widget_remove_tick_callback(drawing_area, tick_id);
+        tick_id = 0;
+    }
+
+    // Both renderers draw the same bars, so either can take over at any time
+    if (preferences_get_visualiser_renderer() == VISUALISER_RENDERER_SNAPSHOT)
+        drawing_area = waveform_visualiser_new();
+    else
+    {
+        drawing_area = gtk_drawing_area_new();
+        gtk_drawing_area_set_draw_func(
+            GTK_DRAWING_AREA(drawing_area),
+            visualiser_draw_function,
+            NULL,
+            NULL
+        );
+    }
+
+    gtk_widget_set_margin_start(drawing_area, 20);
+    gtk_widget_set_margin_end(drawing_area, 20);
+    adw_bin_set_child(ADW_BIN(playback_page), drawing_area);
+
+    if (was_ticking)
+        update_frame_callbacks();
+}
+
 void init_playback_ui(GtkBuilder* builder)
 {
     stack               = GET_WIDGET("playback_stack");
     playback_page       = GET_WIDGET("playback_page");
     empty_page          = GET_WIDGET("playback_empty_page");
-    drawing_area        = GET_WIDGET("drawing_area");
     backwards_button    = GET_WIDGET("backwards_button");
     play_button         = GET_WIDGET("play_button");
     forwards_button     = GET_WIDGET("forwards_button");
     playback_slider     = GET_WIDGET("playback_slider");
+    overview_area       = GET_WIDGET("overview_area");
     playback_bar        = GET_WIDGET("playback_bar");
     mute_button         = GET_WIDGET("mute_button");
     shuffle_button      = GET_WIDGET("shuffle_button");
@@ -158,14 +366,10 @@ void init_playback_ui(GtkBuilder* builder)
     g_signal_connect(mute_button,       "clicked",      G_CALLBACK(on_mute),         NULL);
     g_signal_connect(shuffle_button,    "clicked",      G_CALLBACK(on_shuffle),      NULL);
 
+    create_visualiser_widget();
     visualiser_init(drawing_area);
 
-    gtk_drawing_area_set_draw_func(
-        GTK_DRAWING_AREA(drawing_area),
-        visualiser_draw_function,
-        NULL,
-        NULL
-    );
+    gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(overview_area), draw_overview, NULL, NULL);
 
     update_playback();
 }
@@ -174,6 +378,7 @@ static void remake_audio_stream()
 {
     destroy_audio_stream();
     audio_stream = create_audio_stream(current_entry);
+    overview_request(current_entry->path, on_overview_ready);
     on_play(NULL);
 }
 
@@ -182,15 +387,23 @@ static void destroy_audio_stream()
     if (audio_stream != NULL)
         free_audio_stream(audio_stream);
     audio_stream = NULL;
+
+    // The tick callback stops itself once any fade is over
+    g_clear_handle_id(&housekeeping_id, g_source_remove);
+
+    // Don't leave the last track's overview up while the next one loads
+    overview_cancel();
+    g_clear_pointer(&overview, g_free);
+    gtk_widget_queue_draw(overview_area);
 }
 
 void update_playback()
 {
-    if (g_list_length(playlist) != 0)
+    if (playlist->len != 0)
     {
         // If current song has been removed, go back to start
-        if (g_list_find(playlist, current_entry) == NULL)
-            current_entry = (PlaylistEntry*)playlist->data;
+        if (!playlist_contains(current_entry))
+            current_entry = (PlaylistEntry*)g_ptr_array_index(playlist, 0);
 
         // Enable buttons
         gtk_widget_set_sensitive(playback_bar, true);
@@ -204,6 +417,9 @@ void update_playback()
         // Disable buttons
         gtk_widget_set_sensitive(playback_bar, false);
         destroy_audio_stream();
+
+        // About to be freed
+        current_entry = NULL;
     }
 
     update_stack();
@@ -222,26 +438,97 @@ void set_new_playback_entry(PlaylistEntry* entry)
     update_playback();
 }
 
+void playback_update_visualiser_renderer()
+{
+    // Preferences can change before the main window exists
+    if (playback_page == NULL)
+        return;
+
+    // The old widget goes with adw_bin_set_child
+    create_visualiser_widget();
+    visualiser_set_widget(drawing_area);
+}
+
 void destroy_playback_ui()
 {
     destroy_audio_stream();
     visualiser_free_data();
+    g_queue_clear_full(&held_packets, g_free);
+    g_queue_clear_full(&spare_packets, g_free);
 }
 
-void on_audio_stream_advanced(AudioPacket* packet)
+static gint64 get_audible_time(const AudioPacket* packet)
 {
-    // Since we enqueued the work, the audio stream may have been removed
-    if (audio_stream == NULL)
-        return;
+    gint64 frames = (gint64)(packet->position - anchor_position);
+    gint64 expected_time = anchor_time + frames * G_USEC_PER_SEC / MAX(anchor_rate, 1);
+
+    if (!is_clock_anchored ||
+        packet->rate != anchor_rate ||
+        ABS(packet->time - expected_time) > AUDIO_CLOCK_TOLERANCE_US)
+    {
+        is_clock_anchored = true;
+        anchor_position = packet->position;
+        anchor_time = packet->time;
+        anchor_rate = packet->rate;
+        expected_time = packet->time;
+    }
+
+    return expected_time + (gint64)packet->latency * G_USEC_PER_SEC / MAX(packet->rate, 1);
+}
 
-    // Send data to visualiser
-    visualiser_set_data(packet);
+static void hold_queued_packets()
+{
+    AudioPacket* packet;
+    while ((packet = packet_queue_peek()) != NULL)
+    {
+        HeldPacket* held = g_queue_pop_head(&spare_packets);
+        if (held == NULL)
+            held = g_new(HeldPacket, 1);
+
+        // The ring has already clamped the length to fit
+        held->packet = *packet;
+        held->packet.data = held->samples;
+        memcpy(held->samples, packet->data, sizeof(float) * packet->length);
+
+        g_queue_push_tail(&held_packets, held);
+        packet_queue_pop();
+    }
+}
+
+static void on_audio_stream_advanced(bool is_visible, gint64 now)
+{
+    hold_queued_packets();
+
+    // Use everything the audio thread has produced that can now be heard
+    // (or everything, if nobody can see it anyway)
+    bool advanced = false;
+    HeldPacket* held;
+    while ((held = g_queue_peek_head(&held_packets)) != NULL)
+    {
+        if (is_visible && get_audible_time(&held->packet) > now)
+            break;
+
+        // Since the work was enqueued, the audio stream may have been removed,
+        // and there's no point analysing what nobody will see
+        if (audio_stream != NULL)
+        {
+            if (is_visible)
+                visualiser_set_data(&held->packet);
+            advanced = true;
+        }
+
+        g_queue_push_tail(&spare_packets, g_queue_pop_head(&held_packets));
+    }
+
+    if (!advanced)
+        return;
 
     // Update UI
     double progress = Mix_GetMusicPosition(audio_stream->music) /
         Mix_MusicDuration(audio_stream->music);
     gtk_range_set_value(GTK_RANGE(playback_slider), progress);
-    gtk_widget_queue_draw(drawing_area);
+    if (is_visible)
+        gtk_widget_queue_draw(drawing_area);
 
     // Go to next song when this one finishes
     if (progress >= 1.0)
@@ -251,14 +538,14 @@ void on_audio_stream_advanced(AudioPacket* packet)
 void playback_next()
 {
     // Called from D-Bus so might not make sense
-    if (g_list_length(playlist) > 0)
+    if (playlist->len > 0)
         on_forwards(NULL);
 }
 
 void playback_previous()
 {
     // Called from D-Bus so might not make sense
-    if (g_list_length(playlist) > 0)
+    if (playlist->len > 0)
         on_backwards(NULL);
 }
 
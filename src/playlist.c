@@ -2,10 +2,11 @@
 #include <SDL_mixer.h>
 #include "playlist.h"
 #include "playback.h"
+#include "metadata_cache.h"
 #include "common.h"
 #include "dbus.h"
 
-GList* playlist = NULL;
+GPtrArray* playlist = NULL;
 
 static GtkWidget* playlist_list;
 static GtkWidget* playlist_stack;
@@ -13,11 +14,124 @@ static GtkWidget* playlist_page;
 static GtkWidget* empty_page;
 static GtkWindow* window;
 
-static GtkWidget* create_ui_playlist_entry(PlaylistEntry* playlist_entry);
+// For the pause button, which only the current entry's row shows
+static PlaylistEntry* current_entry = NULL;
+static bool is_current_playing = false;
+
+/*
+    Reading tags means opening each file, which is far too slow to do on the
+    GTK thread for more than a handful, so entries go in straight away with
+    whatever the metadata cache last knew (or placeholder details) and a small
+    pool of threads checks them. Files whose size and modification time still
+    match the cache aren't opened again; only new or changed ones are probed.
+    Clearing the playlist bumps the generation, which makes any probes still
+    queued return at once and any results still in flight be thrown away.
+*/
+#define MAX_PROBE_THREADS 4
+
+typedef struct ProbeJob
+{
+    PlaylistEntry* entry;
+    gint generation;
+    gchar* title;
+    gchar* artist;
+    double duration;
+    bool succeeded;
+    bool is_unchanged; // The cache was right, so there's nothing to update
+} ProbeJob;
+
+static GThreadPool* probe_pool;
+static gint probe_generation = 0;
+static guint pending_probes = 0;
+static bool one_or_more_probes_failed = false;
+
+G_DEFINE_FINAL_TYPE(PlaylistEntry, playlist_entry, G_TYPE_OBJECT)
+
+static void playlist_entry_finalize(GObject* object)
+{
+    PlaylistEntry* entry = WAVEFORM_PLAYLIST_ENTRY(object);
+    g_free((void*)entry->name);
+    g_free((void*)entry->unescaped_name);
+    g_free((void*)entry->artist);
+    g_free((void*)entry->unescaped_artist);
+    g_free((void*)entry->path);
+
+    G_OBJECT_CLASS(playlist_entry_parent_class)->finalize(object);
+}
+
+static void playlist_entry_class_init(PlaylistEntryClass* class)
+{
+    G_OBJECT_CLASS(class)->finalize = playlist_entry_finalize;
+}
+
+static void playlist_entry_init(PlaylistEntry* entry)
+{
+    entry->duration = -1.0;
+}
+
+/*
+    Exposes the playlist array to the list view, which only creates rows for
+    the entries actually on screen (and recycles them as it scrolls). New
+    entries are announced in one go by update_stack, so that loading a big
+    playlist doesn't cost a signal per entry.
+*/
+#define WAVEFORM_TYPE_PLAYLIST_MODEL (waveform_playlist_model_get_type())
+G_DECLARE_FINAL_TYPE(WaveformPlaylistModel, waveform_playlist_model, WAVEFORM, PLAYLIST_MODEL, GObject)
+
+struct _WaveformPlaylistModel
+{
+    GObject parent_instance;
+};
+
+static GListModel* playlist_model;
+static guint model_length = 0; // As far as the list view has been told
+
+static GType waveform_playlist_model_get_item_type(GListModel*)
+{
+    return WAVEFORM_TYPE_PLAYLIST_ENTRY;
+}
+
+static guint waveform_playlist_model_get_n_items(GListModel*)
+{
+    return model_length;
+}
+
+static gpointer waveform_playlist_model_get_item(GListModel*, guint position)
+{
+    if (position >= model_length)
+        return NULL;
+    return g_object_ref(g_ptr_array_index(playlist, position));
+}
+
+static void waveform_playlist_model_list_model_init(GListModelInterface* interface)
+{
+    interface->get_item_type = waveform_playlist_model_get_item_type;
+    interface->get_n_items = waveform_playlist_model_get_n_items;
+    interface->get_item = waveform_playlist_model_get_item;
+}
+
+G_DEFINE_FINAL_TYPE_WITH_CODE(
+    WaveformPlaylistModel,
+    waveform_playlist_model,
+    G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL, waveform_playlist_model_list_model_init)
+)
+
+static void waveform_playlist_model_class_init(WaveformPlaylistModelClass*) {}
+static void waveform_playlist_model_init(WaveformPlaylistModel*) {}
 
 static void update_stack()
 {
-    gint length = g_list_length(playlist);
+    // Tell the list view about anything that's been added since last time
+    guint added = playlist->len - model_length;
+    if (added > 0)
+    {
+        guint position = model_length;
+        model_length = playlist->len;
+        g_list_model_items_changed(playlist_model, position, 0, added);
+    }
+
+    guint length = playlist->len;
     adw_view_stack_set_visible_child(
         ADW_VIEW_STACK(playlist_stack),
         length == 0 ? empty_page : playlist_page
@@ -28,39 +142,64 @@ static void update_stack()
         dbus_set_current_playlist_entry(NULL);
 }
 
-static void free_playlist_entry(void* entry)
+static void reindex_playlist(guint from)
 {
-    g_free((void*)((PlaylistEntry*)entry)->name);
-    g_free((void*)((PlaylistEntry*)entry)->unescaped_name);
-    g_free((void*)((PlaylistEntry*)entry)->artist);
-    g_free((void*)((PlaylistEntry*)entry)->unescaped_artist);
-    g_free((void*)((PlaylistEntry*)entry)->path);
-    free(entry);
+    for (guint i = from; i < playlist->len; ++i)
+        ((PlaylistEntry*)g_ptr_array_index(playlist, i))->index = i;
 }
 
-static void on_playlist_entry_removed(GtkButton* button)
+bool playlist_contains(const PlaylistEntry* entry)
 {
-    // Find row in list
-    GtkWidget* widget = GTK_WIDGET(button);
-    for (int i = 0; i < 3; ++i)
-        widget = gtk_widget_get_parent(widget);
+    return entry != NULL &&
+        entry->index < playlist->len &&
+        g_ptr_array_index(playlist, entry->index) == entry;
+}
 
-    // Remove from playlist
-    PlaylistEntry* entry = g_object_get_data(G_OBJECT(widget), "playlist_entry");
-    free_playlist_entry(entry);
-    playlist = g_list_remove(playlist, entry);
+/*
+    Playback may still be using the old entries, so callers only free them
+    (by unreffing the array) once update_playback has moved on.
+*/
+static GPtrArray* take_playlist()
+{
+    GPtrArray* old_playlist = playlist;
+    playlist = g_ptr_array_new_with_free_func(g_object_unref);
+    current_entry = NULL;
+    g_atomic_int_inc(&probe_generation);
 
-    // Remove from UI
-    gtk_list_box_remove(GTK_LIST_BOX(playlist_list), widget);
+    guint removed = model_length;
+    model_length = 0;
+    g_list_model_items_changed(playlist_model, 0, removed, 0);
 
-    // Update rest of state
+    return old_playlist;
+}
+
+static void remove_playlist_entry(PlaylistEntry* entry)
+{
+    // Remove from playlist (and so the UI), shifting everything after it down
+    guint index = entry->index;
+    g_ptr_array_steal_index(playlist, index);
+    reindex_playlist(index);
+    model_length--;
+    g_list_model_items_changed(playlist_model, index, 1, 0);
+
+    if (entry == current_entry)
+        current_entry = NULL;
+
+    // Update rest of state, and only then let go of the entry
     update_stack();
     update_playback();
+    g_object_unref(entry);
+}
+
+static void on_playlist_entry_removed(GtkButton*, GtkWidget* row)
+{
+    remove_playlist_entry(g_object_get_data(G_OBJECT(row), "playlist_entry"));
 }
 
-static void on_playlist_entry_clicked(GtkGestureClick*, gint, gdouble, gdouble, PlaylistEntry* entry)
+static void on_playlist_entry_clicked(GtkGestureClick* gesture, gint, gdouble, gdouble)
 {
-    set_new_playback_entry(entry);
+    GtkWidget* row = gtk_event_controller_get_widget(GTK_EVENT_CONTROLLER(gesture));
+    set_new_playback_entry(g_object_get_data(G_OBJECT(row), "playlist_entry"));
 }
 
 static void on_playlist_entry_playback_toggled(GtkButton*)
@@ -68,6 +207,22 @@ static void on_playlist_entry_playback_toggled(GtkButton*)
     toggle_playback();
 }
 
+static void update_ui_playlist_entry(GtkWidget* row, PlaylistEntry* entry)
+{
+    adw_preferences_row_set_title(ADW_PREFERENCES_ROW(row), entry->name);
+    adw_action_row_set_subtitle(ADW_ACTION_ROW(row), entry->artist);
+    g_object_set_data(G_OBJECT(row), "playlist_entry", entry);
+
+    GtkWidget* pause_button = g_object_get_data(G_OBJECT(row), "pause_button");
+    gtk_widget_set_visible(pause_button, entry == current_entry);
+    gtk_button_set_icon_name(
+        GTK_BUTTON(pause_button),
+        is_current_playing ? "media-playback-pause" : "media-playback-start"
+    );
+}
+
+static GtkWidget* create_ui_playlist_entry();
+
 static void on_drag_begin(GtkDragSource*, GdkDrag* drag, GtkWidget* widget)
 {
     // Get playlist entry
@@ -78,7 +233,8 @@ static void on_drag_begin(GtkDragSource*, GdkDrag* drag, GtkWidget* widget)
     int height = gtk_widget_get_height(widget);
 
     // Create new dummy widget
-    GtkWidget* dummy_widget = create_ui_playlist_entry(entry);
+    GtkWidget* dummy_widget = create_ui_playlist_entry();
+    update_ui_playlist_entry(dummy_widget, entry);
     gtk_widget_add_css_class(dummy_widget, "drag-entry");
     gtk_widget_set_size_request(dummy_widget, width, height);
 
@@ -86,47 +242,42 @@ static void on_drag_begin(GtkDragSource*, GdkDrag* drag, GtkWidget* widget)
     gtk_drag_icon_set_child(GTK_DRAG_ICON(icon), dummy_widget);
 }
 
-static void on_drop_target_drop(GtkDropTarget*, const GValue* value, gdouble, gdouble, GtkWidget* destination)
+static GdkContentProvider* on_drag_prepare(GtkDragSource*, gdouble, gdouble, GtkWidget* row)
 {
-    GtkWidget* source = g_value_get_object(value);
-    if (source == destination)
-        return;
+    // Rows are recycled, so drag whatever entry the row is showing right now
+    PlaylistEntry* entry = g_object_get_data(G_OBJECT(row), "playlist_entry");
+    return gdk_content_provider_new_typed(WAVEFORM_TYPE_PLAYLIST_ENTRY, entry);
+}
 
-    PlaylistEntry* source_entry = g_object_get_data(G_OBJECT(source), "playlist_entry");
+static gboolean on_drop_target_drop(GtkDropTarget*, const GValue* value, gdouble, gdouble, GtkWidget* destination)
+{
+    PlaylistEntry* source_entry = g_value_get_object(value);
     PlaylistEntry* destination_entry = g_object_get_data(G_OBJECT(destination), "playlist_entry");
-
-    int source_position = g_list_index(playlist, source_entry);
-    int destination_position = g_list_index(playlist, destination_entry);
-    gtk_list_box_remove(GTK_LIST_BOX(playlist_list), source);
-    gtk_list_box_remove(GTK_LIST_BOX(playlist_list), destination);
-
-    // Swap widgets within list
-    if (destination_position > source_position)
-    {
-        gtk_list_box_insert(GTK_LIST_BOX(playlist_list), destination, source_position);
-        gtk_list_box_insert(GTK_LIST_BOX(playlist_list), source, destination_position);
-    }
-    else
-    {
-        gtk_list_box_insert(GTK_LIST_BOX(playlist_list), source, destination_position);
-        gtk_list_box_insert(GTK_LIST_BOX(playlist_list), destination, source_position);
-    }
+    if (source_entry == destination_entry)
+        return false;
 
     // Swap elements in playlist
-    g_list_nth(playlist, source_position)->data = destination_entry;
-    g_list_nth(playlist, destination_position)->data = source_entry;
+    guint source_position = source_entry->index;
+    guint destination_position = destination_entry->index;
+    playlist->pdata[source_position] = destination_entry;
+    playlist->pdata[destination_position] = source_entry;
+    source_entry->index = destination_position;
+    destination_entry->index = source_position;
+
+    // The list view moves the rows to match
+    g_list_model_items_changed(playlist_model, source_position, 1, 1);
+    g_list_model_items_changed(playlist_model, destination_position, 1, 1);
+    return true;
 }
 
-static GtkWidget* create_ui_playlist_entry(PlaylistEntry* playlist_entry)
+static GtkWidget* create_ui_playlist_entry()
 {
-    // Row
+    // Row; filled in when bound to an entry (see update_ui_playlist_entry)
     GtkWidget* entry = adw_action_row_new();
-    adw_preferences_row_set_title(ADW_PREFERENCES_ROW(entry), playlist_entry->name);
-    adw_action_row_set_subtitle(ADW_ACTION_ROW(entry), playlist_entry->artist);
 
     // Make row clickable
     GtkGesture* gesture = gtk_gesture_click_new();
-    g_signal_connect(gesture, "released", G_CALLBACK(on_playlist_entry_clicked), playlist_entry);
+    g_signal_connect(gesture, "released", G_CALLBACK(on_playlist_entry_clicked), NULL);
     gtk_widget_add_controller(entry, GTK_EVENT_CONTROLLER(gesture));
 
     // Pause button
@@ -143,31 +294,21 @@ static GtkWidget* create_ui_playlist_entry(PlaylistEntry* playlist_entry)
     gtk_button_set_icon_name(GTK_BUTTON(remove_button), "edit-delete-symbolic");
     gtk_widget_set_valign(remove_button, GTK_ALIGN_CENTER);
     gtk_widget_add_css_class(remove_button, "flat");
-    g_signal_connect(remove_button, "clicked", G_CALLBACK(on_playlist_entry_removed), NULL);
+    g_signal_connect(remove_button, "clicked", G_CALLBACK(on_playlist_entry_removed), entry);
     adw_action_row_add_suffix(ADW_ACTION_ROW(entry), remove_button);
 
     // Convenience bindings
     g_object_set_data(G_OBJECT(entry), "pause_button", pause_button);
-    g_object_set_data(G_OBJECT(entry), "playlist_entry", playlist_entry);
 
     // Drag and drop source
     GtkDragSource* drag_source = gtk_drag_source_new();
     gtk_drag_source_set_actions(drag_source, GDK_ACTION_MOVE);
-    gtk_drag_source_set_content(
-        drag_source,
-        gdk_content_provider_new_typed(
-            adw_action_row_get_type(),
-            entry
-        )
-    );
     gtk_widget_add_controller(entry, GTK_EVENT_CONTROLLER(drag_source));
+    g_signal_connect(drag_source, "prepare", G_CALLBACK(on_drag_prepare), entry);
     g_signal_connect(drag_source, "drag-begin", G_CALLBACK(on_drag_begin), entry);
 
     // Drag and drop dest
-    GtkDropTarget* target = gtk_drop_target_new(G_TYPE_INVALID, GDK_ACTION_MOVE);
-    gtk_drop_target_set_gtypes(target, (GType[1]) {
-        adw_action_row_get_type()
-    }, 1);
+    GtkDropTarget* target = gtk_drop_target_new(WAVEFORM_TYPE_PLAYLIST_ENTRY, GDK_ACTION_MOVE);
     gtk_widget_add_controller(entry, GTK_EVENT_CONTROLLER(target));
     g_signal_connect(target, "drop", G_CALLBACK(on_drop_target_drop), entry);
 
@@ -180,6 +321,27 @@ static GtkWidget* create_ui_playlist_entry(PlaylistEntry* playlist_entry)
     return entry;
 }
 
+static void on_factory_setup(GtkSignalListItemFactory*, GtkListItem* item, gpointer)
+{
+    gtk_list_item_set_activatable(item, false);
+    gtk_list_item_set_child(item, create_ui_playlist_entry());
+}
+
+static void on_factory_bind(GtkSignalListItemFactory*, GtkListItem* item, gpointer)
+{
+    GtkWidget* row = gtk_list_item_get_child(item);
+    PlaylistEntry* entry = gtk_list_item_get_item(item);
+    update_ui_playlist_entry(row, entry);
+    entry->row = row;
+}
+
+static void on_factory_unbind(GtkSignalListItemFactory*, GtkListItem* item, gpointer)
+{
+    PlaylistEntry* entry = gtk_list_item_get_item(item);
+    if (entry->row == gtk_list_item_get_child(item))
+        entry->row = NULL;
+}
+
 static void add_playlist_entry(
     const gchar* name,
     const gchar* unescaped_name,
@@ -188,59 +350,164 @@ static void add_playlist_entry(
     const gchar* path
 )
 {
-    // Add to playlist
-    PlaylistEntry* entry = malloc(sizeof(PlaylistEntry));
+    // Add to playlist; the UI catches up in update_stack
+    PlaylistEntry* entry = g_object_new(WAVEFORM_TYPE_PLAYLIST_ENTRY, NULL);
     entry->name = name;
     entry->unescaped_name = unescaped_name;
     entry->artist = artist;
     entry->unescaped_artist = unescaped_artist;
     entry->path = path;
-    playlist = g_list_append(playlist, entry);
+    entry->index = playlist->len;
+    g_ptr_array_add(playlist, entry);
+}
+
+static void set_playlist_entry_details(PlaylistEntry* entry, gchar* name, gchar* artist)
+{
+    g_free((void*)entry->name);
+    g_free((void*)entry->unescaped_name);
+    g_free((void*)entry->artist);
+    g_free((void*)entry->unescaped_artist);
+
+    // Sanitise for escape sequences
+    entry->name = g_markup_escape_text(name, -1);
+    entry->unescaped_name = name;
+    entry->artist = g_markup_escape_text(artist, -1);
+    entry->unescaped_artist = artist;
+}
 
-    // Add to UI
-    GtkWidget* widget = create_ui_playlist_entry(entry);
-    gtk_list_box_append(GTK_LIST_BOX(playlist_list), widget);
+static void set_playlist_entry_metadata(PlaylistEntry* entry, const gchar* title, const gchar* artist, double duration)
+{
+    // Missing tags fall back on the file name and an unknown artist
+    gchar* name = strcmp(title, "") != 0 ? g_strdup(title) : g_path_get_basename(entry->path);
+    set_playlist_entry_details(
+        entry,
+        name,
+        g_strdup(strcmp(artist, "") != 0 ? artist : "Unknown artist")
+    );
+    entry->duration = duration;
 }
 
-static bool add_file_to_playlist(GFile* file)
+static gboolean on_probe_done(gpointer data)
 {
-    // Create SDL music object
-    char* file_path = g_file_get_path(file);
-    Mix_Music* music = Mix_LoadMUS(file_path);
-    if (music == NULL)
+    ProbeJob* job = data;
+    PlaylistEntry* entry = job->entry;
+    pending_probes--;
+
+    // Thrown away if the playlist's been cleared (or the entry removed) since
+    if (job->generation == probe_generation && playlist_contains(entry) && !job->is_unchanged)
     {
-        g_critical("failed to load %s", file_path);
-        g_free(file_path);
-        return false;
-    }
+        if (job->succeeded)
+        {
+            set_playlist_entry_metadata(entry, job->title, job->artist, job->duration);
 
-    // Extract info
-    const char* music_title = Mix_GetMusicTitle(music);
-    const char* music_artist = Mix_GetMusicArtistTag(music);
+            if (entry->row != NULL)
+                update_ui_playlist_entry(entry->row, entry);
+            if (entry == current_entry)
+                dbus_set_current_playlist_entry(entry);
+        }
+        else
+        {
+            one_or_more_probes_failed = true;
+            remove_playlist_entry(entry);
+        }
+    }
 
-    // Allocate title
-    char* name;
-    if (strcmp(music_title, "") != 0)
+    // Only complain once everything asked for has been looked at
+    if (pending_probes == 0 && one_or_more_probes_failed)
     {
-        name = malloc(strlen(music_title) + 1);
-        strcpy(name, music_title);
+        one_or_more_probes_failed = false;
+        GtkAlertDialog* alert = gtk_alert_dialog_new("Failed To Load Files");
+        gtk_alert_dialog_set_detail(alert, "One or more files failed to load");
+        gtk_alert_dialog_show(alert, window);
+        g_object_unref(alert);
     }
-    else name = g_file_get_basename(file);
 
-    // Allocate artist
-    if (strcmp(music_artist, "") == 0)
-        music_artist = "Unknown artist";
-    char* artist = malloc(strlen(music_artist) + 1);
-    strcpy(artist, music_artist);
+    g_object_unref(job->entry);
+    g_free(job->title);
+    g_free(job->artist);
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
 
-    // Sanitise for escape sequences
-    gchar* name_s = g_markup_escape_text(name, -1);
-    gchar* artist_s = g_markup_escape_text(artist, -1);
-    Mix_FreeMusic(music);
+static void probe_file(gpointer data, gpointer)
+{
+    ProbeJob* job = data;
+    if (job->generation == g_atomic_int_get(&probe_generation))
+    {
+        // Taken first, so that a file changing mid-probe just looks stale next time
+        TrackMetadata metadata = { 0 };
+        bool is_stamped = metadata_cache_stamp(job->entry->path, &metadata);
+
+        // The entry already shows what the cache has, if that's still right
+        TrackMetadata cached;
+        if (is_stamped &&
+            metadata_cache_lookup(job->entry->path, &cached) &&
+            metadata_cache_is_current(&cached, &metadata))
+        {
+            job->is_unchanged = true;
+            g_idle_add(on_probe_done, job);
+            return;
+        }
 
-    // Add to program
-    add_playlist_entry(name_s, name, artist_s, artist, file_path);
-    return true;
+        // Headers only where possible, so a big library doesn't get decoded just to list it
+        Mix_MusicTags tags;
+        Mix_Music* music = NULL;
+        if (Mix_ProbeMusicTags(job->entry->path, &tags, &job->duration) == 0)
+        {
+            job->title = g_strdup(tags.title != NULL ? tags.title : "");
+            job->artist = g_strdup(tags.artist != NULL ? tags.artist : "");
+            metadata.sample_rate = tags.frequency;
+            metadata.codec = tags.type;
+            job->succeeded = true;
+            Mix_FreeMusicTags(&tags);
+        }
+
+        // Otherwise create SDL music object (which doesn't let on its sample rate)
+        else if ((music = Mix_LoadMUS(job->entry->path)) != NULL)
+        {
+            job->title = g_strdup(Mix_GetMusicTitleTag(music));
+            job->artist = g_strdup(Mix_GetMusicArtistTag(music));
+            job->duration = Mix_MusicDuration(music);
+            metadata.codec = Mix_GetMusicType(music);
+            job->succeeded = true;
+            Mix_FreeMusic(music);
+        }
+        else
+            g_critical("failed to load %s", job->entry->path);
+
+        // Failures aren't remembered, as the file may well be fixed later
+        if (job->succeeded && is_stamped)
+        {
+            metadata.title = job->title;
+            metadata.artist = job->artist;
+            metadata.duration = job->duration;
+            metadata_cache_store(job->entry->path, &metadata);
+        }
+    }
+
+    // Whatever happened, the GTK thread has to hear about it
+    g_idle_add(on_probe_done, job);
+}
+
+static void add_file_to_playlist(GFile* file)
+{
+    gchar* file_path = g_file_get_path(file);
+    add_playlist_entry(NULL, NULL, NULL, NULL, file_path);
+    PlaylistEntry* entry = g_ptr_array_index(playlist, playlist->len - 1);
+
+    // Use what was found last time if there's anything, else the file name for now...
+    TrackMetadata metadata;
+    if (metadata_cache_lookup(file_path, &metadata))
+        set_playlist_entry_metadata(entry, metadata.title, metadata.artist, metadata.duration);
+    else
+        set_playlist_entry_details(entry, g_file_get_basename(file), g_strdup("Loading…"));
+
+    // ...and the real details once the file's been checked (and read, if need be)
+    ProbeJob* job = g_new0(ProbeJob, 1);
+    job->entry = g_object_ref(entry);
+    job->generation = probe_generation;
+    pending_probes++;
+    g_thread_pool_push(probe_pool, job, NULL);
 }
 
 static void on_playlist_add_dialog_ready(GObject* dialog, GAsyncResult* result, gpointer)
@@ -252,22 +519,13 @@ static void on_playlist_add_dialog_ready(GObject* dialog, GAsyncResult* result,
         return;
     }
 
-    bool one_or_more_failures = false;
     for (guint i = 0; i < g_list_model_get_n_items(list); ++i)
     {
         GFile* file = g_list_model_get_item(list, i);
-        if (!add_file_to_playlist(file))
-            one_or_more_failures = true;
+        add_file_to_playlist(file);
         g_object_unref(file);
     }
 
-    if (one_or_more_failures)
-    {
-        GtkAlertDialog* alert = gtk_alert_dialog_new("Failed To Load Selection");
-        gtk_alert_dialog_set_detail(alert, "One or more files failed to load");
-        gtk_alert_dialog_show(alert, window);
-    }
-
     g_object_unref(list);
     g_object_unref(dialog);
 
@@ -318,11 +576,10 @@ static void on_playlist_clear_confirmed(GObject* self, GAsyncResult* result, gpo
 
     if (index == 1)
     {
-        g_list_free_full(playlist, free_playlist_entry);
-        playlist = NULL;
-        gtk_list_box_remove_all(GTK_LIST_BOX(playlist_list));
+        GPtrArray* old_playlist = take_playlist();
         update_stack();
         update_playback();
+        g_ptr_array_unref(old_playlist);
     }
 }
 
@@ -356,6 +613,27 @@ void init_playlist_ui(GtkBuilder* builder, GtkWindow* _window)
     playlist_page   = GET_WIDGET("playlist_page");
     empty_page      = GET_WIDGET("playlist_empty_page");
     window = _window;
+    playlist = g_ptr_array_new_with_free_func(g_object_unref);
+    probe_pool = g_thread_pool_new(
+        probe_file,
+        NULL,
+        MIN((int)g_get_num_processors(), MAX_PROBE_THREADS),
+        FALSE,
+        NULL
+    );
+
+    // Only visible rows exist, so this stays cheap however long the playlist
+    playlist_model = g_object_new(WAVEFORM_TYPE_PLAYLIST_MODEL, NULL);
+    GtkListItemFactory* factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", G_CALLBACK(on_factory_setup), NULL);
+    g_signal_connect(factory, "bind", G_CALLBACK(on_factory_bind), NULL);
+    g_signal_connect(factory, "unbind", G_CALLBACK(on_factory_unbind), NULL);
+    gtk_list_view_set_factory(GTK_LIST_VIEW(playlist_list), factory);
+    gtk_list_view_set_model(
+        GTK_LIST_VIEW(playlist_list),
+        GTK_SELECTION_MODEL(gtk_no_selection_new(g_object_ref(playlist_model)))
+    );
+    g_object_unref(factory);
 
     // Add button
     GtkWidget* playlist_add_button = GET_WIDGET("playlist_add_button");
@@ -371,28 +649,26 @@ void init_playlist_ui(GtkBuilder* builder, GtkWindow* _window)
 
 void destroy_playlist_ui()
 {
-    g_list_free_full(playlist, free_playlist_entry);
+    // Anything still queued returns straight away
+    g_atomic_int_inc(&probe_generation);
+    g_thread_pool_free(probe_pool, FALSE, TRUE);
+
+    model_length = 0;
+    g_ptr_array_unref(playlist);
+    g_object_unref(playlist_model);
 }
 
 void set_current_playlist_entry(PlaylistEntry* entry, bool is_playing)
 {
-    GtkWidget* row = gtk_widget_get_first_child(playlist_list);
-    while (row != NULL)
-    {
-        if (strcmp(gtk_widget_get_name(row), "AdwActionRow") == 0)
-        {
-            // Row found; ammend
-            GtkWidget* pause_button = (GtkWidget*)g_object_get_data(G_OBJECT(row), "pause_button");
-            PlaylistEntry* playlist_entry = (PlaylistEntry*) g_object_get_data(G_OBJECT(row), "playlist_entry");
-            gtk_widget_set_visible(pause_button, playlist_entry == entry);
-            gtk_button_set_icon_name(
-                GTK_BUTTON(pause_button),
-                is_playing ? "media-playback-pause" : "media-playback-start"
-            );
-        }
-
-        row = gtk_widget_get_next_sibling(row);
-    }
+    PlaylistEntry* previous_entry = current_entry;
+    current_entry = entry;
+    is_current_playing = is_playing;
+
+    // Only rows on screen exist; the rest catch up when they're bound
+    if (previous_entry != NULL && previous_entry->row != NULL)
+        update_ui_playlist_entry(previous_entry->row, previous_entry);
+    if (entry != NULL && entry->row != NULL)
+        update_ui_playlist_entry(entry->row, entry);
 }
 
 static void on_save_dialog_done(GObject* self, GAsyncResult* result, gpointer)
@@ -413,10 +689,9 @@ static void on_save_dialog_done(GObject* self, GAsyncResult* result, gpointer)
 
     if (stream != NULL)
     {
-        GList* current = playlist;
-        while (current != NULL)
+        for (guint i = 0; i < playlist->len; ++i)
         {
-            PlaylistEntry* entry = (PlaylistEntry*)current->data;
+            PlaylistEntry* entry = (PlaylistEntry*)g_ptr_array_index(playlist, i);
             g_output_stream_printf(
                 G_OUTPUT_STREAM(stream),
                 NULL,
@@ -424,7 +699,6 @@ static void on_save_dialog_done(GObject* self, GAsyncResult* result, gpointer)
                 NULL,
                 "%s\n", entry->path
             );
-            current = current->next;
         }
 
         g_output_stream_close(G_OUTPUT_STREAM(stream), NULL, NULL);
@@ -441,16 +715,10 @@ static bool load_playlist_from_file(GFile* file, bool delete_old_playlist)
     GFileInputStream* stream = g_file_read(file, NULL, NULL);
     if (stream != NULL)
     {
-        if (delete_old_playlist)
-        {
-            g_list_free_full(playlist, free_playlist_entry);
-            playlist = NULL;
-            gtk_list_box_remove_all(GTK_LIST_BOX(playlist_list));
-        }
+        GPtrArray* old_playlist = delete_old_playlist ? take_playlist() : NULL;
 
         // Read each line
         GDataInputStream* data_stream = g_data_input_stream_new(G_INPUT_STREAM(stream));
-        bool one_or_more_failures = false;
         while (true)
         {
             gsize length;
@@ -461,22 +729,16 @@ static bool load_playlist_from_file(GFile* file, bool delete_old_playlist)
 
             // file will never be NULL
             GFile* file = g_file_new_for_path(line);
-            if (!add_file_to_playlist(file))
-                one_or_more_failures = true;
+            add_file_to_playlist(file);
             g_object_unref(file);
             g_free(line);
         }
 
-        if (one_or_more_failures)
-        {
-            GtkAlertDialog* alert = gtk_alert_dialog_new("Failed To Load Playlist");
-            gtk_alert_dialog_set_detail(alert, "One or more files failed to load");
-            gtk_alert_dialog_show(alert, window);
-        }
-
         // Update UI
         update_stack();
         update_playback();
+        if (old_playlist != NULL)
+            g_ptr_array_unref(old_playlist);
 
         g_object_unref(data_stream);
         g_object_unref(stream);
@@ -498,7 +760,7 @@ static void on_load_dialog_done(GObject* self, GAsyncResult* result, gpointer)
 
 void on_playlist_save()
 {
-    if (g_list_length(playlist) == 0)
+    if (playlist->len == 0)
     {
         GtkAlertDialog* alert = gtk_alert_dialog_new("Unable To Save Playlist");
         gtk_alert_dialog_set_detail(alert, "Playlist is currently empty");
@@ -2,16 +2,35 @@
 #include "common.h"
 #include "audio_stream.h"
 #include "presets.h"
+#include "equaliser.h"
+#include "visualiser.h"
+#include "playback.h"
 #include <adwaita.h>
+#include <stdatomic.h>
 
 static GSettings* settings;
 static GObject* window = NULL;
 
 static GtkWidget* frequency_range_group;
+static GVariant* frequency_ranges_variant = NULL;
 static const FrequencyRange* frequency_ranges;
 static size_t n_frequency_ranges = 0;
 static size_t previous_n_ranges = 0;
 
+/*
+    The current snapshot is swapped atomically, and the audio thread announces
+    which snapshot it is reading through a single hazard pointer. Retired
+    snapshots are kept on the GTK thread until they are no longer in use.
+*/
+static _Atomic(DspConfig*) dsp_config = NULL;
+static _Atomic(DspConfig*) dsp_config_in_use = NULL;
+static GList* retired_dsp_configs = NULL;
+static unsigned int dsp_config_version = 0;
+
+static Convolver* convolver = NULL;
+static GCancellable* impulse_response_cancellable = NULL; // While one loads
+static GtkWidget* impulse_response_row = NULL;
+
 static void on_preferences_close(GtkWidget*);
 static void on_reset_preferences(GtkButton*);
 static void on_playback_speed_changed(GtkAdjustment*, gpointer);
@@ -22,7 +41,14 @@ static void on_clear_frequency_ranges(GtkButton*);
 static void on_frequency_range_min_changed(GtkEditable*, gpointer);
 static void on_frequency_range_max_changed(GtkEditable*, gpointer);
 static void on_frequency_range_multiplier_changed(GtkEditable*, gpointer);
-
+static void on_choose_impulse_response(GtkButton*);
+static void on_impulse_response_chosen(GObject* self, GAsyncResult* result, gpointer);
+
+static void update_frequency_ranges();
+static void publish_dsp_config();
+static void reclaim_dsp_configs(bool force);
+static void free_dsp_config(DspConfig* config);
+static void update_impulse_response_ui();
 static void add_empty_frequency_range_ui();
 static void add_frequency_range_to_ui(float min, float max, float multiplier, int i);
 
@@ -37,8 +63,8 @@ void init_preferences()
 #endif
 
     // Get initial frequency ranges
-    GVariant* variant = g_settings_get_value(settings, "frequency-ranges");
-    frequency_ranges = g_variant_get_fixed_array(variant, &n_frequency_ranges, sizeof(FrequencyRange));
+    update_frequency_ranges();
+    publish_dsp_config();
 
     g_signal_connect(settings, "changed", G_CALLBACK(on_settings_changed), NULL);
 }
@@ -58,17 +84,31 @@ void toggle_preferences_window()
     gtk_window_set_modal(GTK_WINDOW(window), false);
 
     GtkWidget* visualisation_type       = GET_WIDGET("visualisation_type");
+    GtkWidget* visualiser_renderer      = GET_WIDGET("visualiser_renderer");
     GtkWidget* gap_size                 = GET_WIDGET("gap_size");
     GtkWidget* fade_edges               = GET_WIDGET("fade_edges");
     GtkWidget* minimum_frequency        = GET_WIDGET("minimum_frequency");
     GtkWidget* maximum_frequency        = GET_WIDGET("maximum_frequency");
     GtkWidget* use_bark_scale           = GET_WIDGET("use_bark_scale");
     GtkWidget* gain                     = GET_WIDGET("gain");
+    GtkWidget* analyser_size            = GET_WIDGET("analyser_size");
+    GtkWidget* analyser_window          = GET_WIDGET("analyser_window");
+    GtkWidget* analyser_hop             = GET_WIDGET("analyser_hop");
+    GtkWidget* use_constant_q           = GET_WIDGET("use_constant_q");
+    GtkWidget* spectrogram_history      = GET_WIDGET("spectrogram_history");
+    GtkWidget* oscilloscope_trigger     = GET_WIDGET("oscilloscope_trigger");
+    GtkWidget* smoothing_frames         = GET_WIDGET("smoothing_frames");
+    GtkWidget* smoothing_attack         = GET_WIDGET("smoothing_attack");
+    GtkWidget* smoothing_release        = GET_WIDGET("smoothing_release");
     GtkWidget* playback_speed           = GET_WIDGET("playback_speed");
     GtkWidget* reset_button             = GET_WIDGET("reset_button");
     GtkWidget* enable_equaliser         = GET_WIDGET("enable_equaliser");
+    GtkWidget* equaliser_mode           = GET_WIDGET("equaliser_mode");
+    GtkWidget* equaliser_latency        = GET_WIDGET("equaliser_latency");
     GtkWidget* add_frequency_range      = GET_WIDGET("add_frequency_range");
     GtkWidget* clear_frequency_ranges   = GET_WIDGET("clear_frequency_ranges");
+    GtkWidget* enable_convolution       = GET_WIDGET("enable_convolution");
+    GtkWidget* choose_impulse_response  = GET_WIDGET("choose_impulse_response");
     GtkWidget* preset_menu              = GET_WIDGET("preset_menu");
 
     // Init presets menu
@@ -79,6 +119,9 @@ void toggle_preferences_window()
     preferences_force_frequency_range_ui_update();
     on_settings_changed(NULL, "frequency-ranges", NULL);
 
+    impulse_response_row = GET_WIDGET("impulse_response_row");
+    update_impulse_response_ui();
+
     g_settings_bind(
         settings,
         "visualisation-type",
@@ -87,6 +130,14 @@ void toggle_preferences_window()
         G_SETTINGS_BIND_DEFAULT
     );
 
+    g_settings_bind(
+        settings,
+        "visualiser-renderer",
+        visualiser_renderer,
+        "selected",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
     g_settings_bind(
         settings,
         "gap-size",
@@ -135,6 +186,78 @@ void toggle_preferences_window()
         G_SETTINGS_BIND_DEFAULT
     );
 
+    g_settings_bind(
+        settings,
+        "analyser-size",
+        analyser_size,
+        "selected",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "analyser-window",
+        analyser_window,
+        "selected",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "analyser-hop",
+        analyser_hop,
+        "value",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "use-constant-q",
+        use_constant_q,
+        "active",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "oscilloscope-trigger",
+        oscilloscope_trigger,
+        "active",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "spectrogram-history",
+        spectrogram_history,
+        "value",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "smoothing-frames",
+        smoothing_frames,
+        "value",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "smoothing-attack",
+        smoothing_attack,
+        "value",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "smoothing-release",
+        smoothing_release,
+        "value",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
     g_settings_bind(
         settings,
         "playback-speed",
@@ -151,6 +274,30 @@ void toggle_preferences_window()
         G_SETTINGS_BIND_DEFAULT
     );
 
+    g_settings_bind(
+        settings,
+        "equaliser-mode",
+        equaliser_mode,
+        "selected",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "equaliser-latency",
+        equaliser_latency,
+        "selected",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
+    g_settings_bind(
+        settings,
+        "convolution-enabled",
+        enable_convolution,
+        "active",
+        G_SETTINGS_BIND_DEFAULT
+    );
+
     GtkAdjustment* speed_adjustment = adw_spin_row_get_adjustment(ADW_SPIN_ROW(playback_speed));
     g_signal_connect(window, "destroy", G_CALLBACK(on_preferences_close), NULL);
     g_signal_connect(reset_button, "clicked", G_CALLBACK(on_reset_preferences), NULL);
@@ -158,6 +305,7 @@ void toggle_preferences_window()
     g_signal_connect(enable_equaliser, "notify::active", G_CALLBACK(on_equaliser_toggled), NULL);
     g_signal_connect(add_frequency_range, "clicked", G_CALLBACK(on_add_frequency_range), NULL);
     g_signal_connect(clear_frequency_ranges, "clicked", G_CALLBACK(on_clear_frequency_ranges), NULL);
+    g_signal_connect(choose_impulse_response, "clicked", G_CALLBACK(on_choose_impulse_response), NULL);
     on_equaliser_toggled(G_OBJECT(enable_equaliser), NULL, NULL);
 
     g_object_unref(builder);
@@ -166,6 +314,15 @@ void toggle_preferences_window()
 
 void free_preferences()
 {
+    // Audio has been closed by now, so nothing can still be reading these
+    if (impulse_response_cancellable != NULL)
+        g_cancellable_cancel(impulse_response_cancellable);
+    g_clear_object(&impulse_response_cancellable);
+    reclaim_dsp_configs(true);
+    free_dsp_config(atomic_exchange(&dsp_config, NULL));
+    convolver_unref(convolver);
+
+    g_variant_unref(frequency_ranges_variant);
     g_object_unref(settings);
 }
 
@@ -176,10 +333,20 @@ int preferences_get_gap_size()
 
 VisualisationType preferences_get_visualisation_type()
 {
-    if (g_settings_get_int(settings, "visualisation-type") == 0)
-        return VISUALISATION_TYPE_FREQUENCY_DOMAIN;
+    switch (g_settings_get_int(settings, "visualisation-type"))
+    {
+        case 0:  return VISUALISATION_TYPE_FREQUENCY_DOMAIN;
+        case 2:  return VISUALISATION_TYPE_SPECTROGRAM;
+        default: return VISUALISATION_TYPE_TIME_DOMAIN;
+    }
+}
+
+VisualiserRenderer preferences_get_visualiser_renderer()
+{
+    if (g_settings_get_int(settings, "visualiser-renderer") == 1)
+        return VISUALISER_RENDERER_SNAPSHOT;
     else
-        return VISUALISATION_TYPE_TIME_DOMAIN;
+        return VISUALISER_RENDERER_CAIRO;
 }
 
 bool preferences_get_fade_edges()
@@ -207,24 +374,81 @@ float preferences_get_gain()
     return (float)g_settings_get_int(settings, "gain") / 10.0f;
 }
 
-float preferences_get_playback_speed()
+int preferences_get_analyser_size()
 {
-    return (float)g_settings_get_double(settings, "playback-speed");
+    // Stored as an index into 2048, 4096, 8192 and 16384
+    return 2048 << g_settings_get_int(settings, "analyser-size");
+}
+
+AnalyserWindow preferences_get_analyser_window()
+{
+    if (g_settings_get_int(settings, "analyser-window") == 1)
+        return ANALYSER_WINDOW_BLACKMAN;
+    else
+        return ANALYSER_WINDOW_HANN;
+}
+
+int preferences_get_analyser_hop()
+{
+    return g_settings_get_int(settings, "analyser-hop");
+}
+
+bool preferences_get_use_constant_q()
+{
+    return g_settings_get_boolean(settings, "use-constant-q");
+}
+
+bool preferences_get_oscilloscope_trigger()
+{
+    return g_settings_get_boolean(settings, "oscilloscope-trigger");
+}
+
+int preferences_get_spectrogram_history()
+{
+    return g_settings_get_int(settings, "spectrogram-history");
 }
 
-bool preferences_get_equaliser_enabled()
+int preferences_get_smoothing_frames()
 {
-    return g_settings_get_boolean(settings, "equaliser-enabled");
+    return g_settings_get_int(settings, "smoothing-frames");
 }
 
-int preferences_get_n_frequency_ranges()
+int preferences_get_smoothing_attack()
 {
-    return n_frequency_ranges;
+    return g_settings_get_int(settings, "smoothing-attack");
 }
 
-const FrequencyRange* preferences_get_frequency_ranges()
+int preferences_get_smoothing_release()
 {
-    return frequency_ranges;
+    return g_settings_get_int(settings, "smoothing-release");
+}
+
+float preferences_get_playback_speed()
+{
+    return (float)g_settings_get_double(settings, "playback-speed");
+}
+
+const DspConfig* preferences_acquire_dsp_config()
+{
+    /*
+        Announce the snapshot before using it, then check it wasn't swapped out
+        in the meantime. If it was, the GTK thread may not have seen our hazard
+        pointer, so try again with the new one.
+    */
+    DspConfig* config;
+    do
+    {
+        config = atomic_load(&dsp_config);
+        atomic_store(&dsp_config_in_use, config);
+    }
+    while (config != atomic_load(&dsp_config));
+
+    return config;
+}
+
+void preferences_release_dsp_config()
+{
+    atomic_store(&dsp_config_in_use, NULL);
 }
 
 void preferences_set_frequency_ranges(const FrequencyRange* ranges, size_t n)
@@ -258,17 +482,28 @@ static void on_reset_confirmed(GObject* self, GAsyncResult* result, gpointer)
         // Only reset preferences on visualisation page
         g_settings_reset(settings, "gap-size");
         g_settings_reset(settings, "visualisation-type");
+        g_settings_reset(settings, "visualiser-renderer");
         g_settings_reset(settings, "fade-edges");
         g_settings_reset(settings, "minimum-frequency");
         g_settings_reset(settings, "maximum-frequency");
         g_settings_reset(settings, "use-bark-scale");
         g_settings_reset(settings, "gain");
+        g_settings_reset(settings, "analyser-size");
+        g_settings_reset(settings, "analyser-window");
+        g_settings_reset(settings, "analyser-hop");
+        g_settings_reset(settings, "use-constant-q");
+        g_settings_reset(settings, "spectrogram-history");
+        g_settings_reset(settings, "oscilloscope-trigger");
+        g_settings_reset(settings, "smoothing-frames");
+        g_settings_reset(settings, "smoothing-attack");
+        g_settings_reset(settings, "smoothing-release");
     }
 }
 
 static void on_preferences_close(GtkWidget*)
 {
     window = NULL;
+    impulse_response_row = NULL;
 }
 
 static void on_reset_preferences(GtkButton*)
@@ -299,13 +534,160 @@ static void on_playback_speed_changed(GtkAdjustment* adjustment, gpointer)
     set_audio_speed(gtk_adjustment_get_value(adjustment));
 }
 
+static void update_frequency_ranges()
+{
+    GVariant* variant = g_settings_get_value(settings, "frequency-ranges");
+    frequency_ranges = g_variant_get_fixed_array(variant, &n_frequency_ranges, sizeof(FrequencyRange));
+
+    // The old array is only referenced by the UI (and older snapshots copy it)
+    if (frequency_ranges_variant != NULL)
+        g_variant_unref(frequency_ranges_variant);
+    frequency_ranges_variant = variant;
+}
+
+static void publish_dsp_config()
+{
+    DspConfig* config = malloc(sizeof(DspConfig) + sizeof(FrequencyRange) * n_frequency_ranges);
+    config->version = ++dsp_config_version;
+    config->equaliser_enabled = g_settings_get_boolean(settings, "equaliser-enabled");
+    config->equaliser_mode = g_settings_get_int(settings, "equaliser-mode") == 1 ?
+        EQUALISER_MODE_IIR : EQUALISER_MODE_FFT;
+    config->equaliser_latency = g_settings_get_int(settings, "equaliser-latency");
+    config->convolver = convolver != NULL ? convolver_ref(convolver) : NULL;
+    config->n_frequency_ranges = n_frequency_ranges;
+    memcpy(config->frequency_ranges, frequency_ranges, sizeof(FrequencyRange) * n_frequency_ranges);
+
+    DspConfig* old_config = atomic_exchange(&dsp_config, config);
+    if (old_config != NULL)
+        retired_dsp_configs = g_list_prepend(retired_dsp_configs, old_config);
+
+    reclaim_dsp_configs(false);
+}
+
+static void reclaim_dsp_configs(bool force)
+{
+    DspConfig* in_use = atomic_load(&dsp_config_in_use);
+
+    GList* current = retired_dsp_configs;
+    while (current != NULL)
+    {
+        GList* next = current->next;
+        if (force || current->data != in_use)
+        {
+            free_dsp_config(current->data);
+            retired_dsp_configs = g_list_delete_link(retired_dsp_configs, current);
+        }
+        current = next;
+    }
+}
+
+static void free_dsp_config(DspConfig* config)
+{
+    if (config == NULL) return;
+    convolver_unref(config->convolver);
+    free(config);
+}
+
+static void set_convolver(Convolver* new_convolver)
+{
+    // Snapshots hold their own reference, so the old one lives on until reclaimed
+    convolver_unref(convolver);
+    convolver = new_convolver;
+    publish_dsp_config();
+}
+
+static void load_impulse_response_thread(GTask* task, gpointer, gpointer task_data, GCancellable*)
+{
+    g_task_return_pointer(task, convolver_new(task_data), (GDestroyNotify)convolver_unref);
+}
+
+static void on_impulse_response_loaded(GObject*, GAsyncResult* result, gpointer)
+{
+    // Cancelled tasks report an error here, having been superseded since
+    GError* error = NULL;
+    Convolver* new_convolver = g_task_propagate_pointer(G_TASK(result), &error);
+    if (error != NULL)
+    {
+        g_error_free(error);
+        return;
+    }
+
+    // NULL if it failed to load, which turns convolution off
+    g_clear_object(&impulse_response_cancellable);
+    set_convolver(new_convolver);
+}
+
+void preferences_reload_impulse_response()
+{
+    // Whatever was still loading is out of date now
+    if (impulse_response_cancellable != NULL)
+        g_cancellable_cancel(impulse_response_cancellable);
+    g_clear_object(&impulse_response_cancellable);
+
+    gchar* path = g_settings_get_string(settings, "impulse-response");
+    if (!g_settings_get_boolean(settings, "convolution-enabled") || strlen(path) == 0)
+    {
+        g_free(path);
+        set_convolver(NULL);
+        return;
+    }
+
+    /*
+        Decoding, resampling and transforming up to ten seconds of audio would
+        freeze the UI, so it happens on a worker thread, with the previous
+        impulse response carrying on until the new one is published.
+    */
+    impulse_response_cancellable = g_cancellable_new();
+    GTask* task = g_task_new(NULL, impulse_response_cancellable, on_impulse_response_loaded, NULL);
+    g_task_set_task_data(task, path, g_free);
+    g_task_run_in_thread(task, load_impulse_response_thread);
+    g_object_unref(task);
+}
+
+static void update_impulse_response_ui()
+{
+    if (impulse_response_row == NULL) return;
+
+    gchar* path = g_settings_get_string(settings, "impulse-response");
+    gchar* name = strlen(path) > 0 ? g_path_get_basename(path) : g_strdup("None");
+    adw_action_row_set_subtitle(ADW_ACTION_ROW(impulse_response_row), name);
+    g_free(name);
+    g_free(path);
+}
+
 static void on_settings_changed(GSettings*, gchar* key, gpointer)
 {
+    // The visualiser knows which of its settings need the bars rebuilding
+    if (visualiser_setting_changed(key))
+        return;
+
+    if (strcmp(key, "visualiser-renderer") == 0)
+    {
+        playback_update_visualiser_renderer();
+        return;
+    }
+
+    if (strcmp(key, "convolution-enabled") == 0 ||
+        strcmp(key, "impulse-response") == 0)
+    {
+        preferences_reload_impulse_response();
+        update_impulse_response_ui();
+        return;
+    }
+
+    if (strcmp(key, "equaliser-enabled") == 0 ||
+        strcmp(key, "equaliser-mode") == 0 ||
+        strcmp(key, "equaliser-latency") == 0)
+    {
+        publish_dsp_config();
+        return;
+    }
+
     if (strcmp(key, "frequency-ranges") != 0) return;
 
     // Update data
-    GVariant* variant = g_settings_get_value(settings, "frequency-ranges");
-    frequency_ranges = g_variant_get_fixed_array(variant, &n_frequency_ranges, sizeof(FrequencyRange));
+    update_frequency_ranges();
+    publish_dsp_config();
 
     // Avoid re-drawing UI when we don't need to
     if (previous_n_ranges != n_frequency_ranges)
@@ -409,11 +791,6 @@ static void add_frequency_range_to_ui(float min, float max, float multiplier, in
     adw_preferences_row_set_title(ADW_PREFERENCES_ROW(spin_max), "Maximum Frequency");
     adw_preferences_row_set_title(ADW_PREFERENCES_ROW(spin_multiplier), "Multiplier");
 
-    adw_action_row_set_subtitle(
-        ADW_ACTION_ROW(spin_multiplier),
-        "Values very close or equal to zero may introduce some minor crackling"
-    );
-
     adw_spin_row_set_value(ADW_SPIN_ROW(spin_min), min);
     adw_spin_row_set_value(ADW_SPIN_ROW(spin_max), max);
     adw_spin_row_set_value(ADW_SPIN_ROW(spin_multiplier), multiplier);
@@ -428,3 +805,42 @@ static void add_frequency_range_to_ui(float min, float max, float multiplier, in
 
     adw_preferences_group_add(ADW_PREFERENCES_GROUP(frequency_range_group), row);
 }
+
+static void on_choose_impulse_response(GtkButton*)
+{
+    GtkFileDialog* dialog = gtk_file_dialog_new();
+    gtk_file_dialog_set_title(dialog, "Choose Impulse Response");
+
+    GtkFileFilter* filter = gtk_file_filter_new();
+    gtk_file_filter_set_name(filter, "WAV files");
+    gtk_file_filter_add_suffix(filter, "wav");
+
+    GListStore* filters = g_list_store_new(GTK_TYPE_FILE_FILTER);
+    g_list_store_append(filters, filter);
+    gtk_file_dialog_set_filters(dialog, G_LIST_MODEL(filters));
+
+    gtk_file_dialog_open(
+        dialog,
+        GTK_WINDOW(window),
+        NULL,
+        on_impulse_response_chosen,
+        NULL
+    );
+
+    g_object_unref(filters);
+    g_object_unref(filter);
+    g_object_unref(dialog);
+}
+
+static void on_impulse_response_chosen(GObject* self, GAsyncResult* result, gpointer)
+{
+    GFile* file = gtk_file_dialog_open_finish(GTK_FILE_DIALOG(self), result, NULL);
+    if (file == NULL) return;
+
+    gchar* path = g_file_get_path(file);
+    if (path != NULL)
+        g_settings_set_string(settings, "impulse-response", path);
+
+    g_free(path);
+    g_object_unref(file);
+}
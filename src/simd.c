@@ -0,0 +1,205 @@
+#include "simd.h"
+#include <stddef.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+    Stereo is by far the most common case, so it gets a vectorised path four
+    samples at a time. Anything else (and any leftover samples) falls back to
+    plain loops.
+*/
+
+void simd_deinterleave(const float* input, float* const* outputs, int n_channels, int n_samples)
+{
+    int i = 0;
+
+#if defined(__SSE__) || defined(__ARM_NEON)
+    if (n_channels == 2)
+    {
+        float* left = outputs[0];
+        float* right = outputs[1];
+
+        for (; i + 4 <= n_samples; i += 4)
+        {
+        #if defined(__SSE__)
+            __m128 a = _mm_loadu_ps(input + i * 2);
+            __m128 b = _mm_loadu_ps(input + i * 2 + 4);
+            _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        #else
+            float32x4x2_t samples = vld2q_f32(input + i * 2);
+            vst1q_f32(left + i, samples.val[0]);
+            vst1q_f32(right + i, samples.val[1]);
+        #endif
+        }
+    }
+#endif
+
+    for (; i < n_samples; ++i)
+        for (int c = 0; c < n_channels; ++c)
+            outputs[c][i] = input[i * n_channels + c];
+}
+
+void simd_interleave(const float* const* inputs, float* output, int n_channels, int n_samples)
+{
+    int i = 0;
+
+#if defined(__SSE__) || defined(__ARM_NEON)
+    if (n_channels == 2)
+    {
+        const float* left = inputs[0];
+        const float* right = inputs[1];
+
+        for (; i + 4 <= n_samples; i += 4)
+        {
+        #if defined(__SSE__)
+            __m128 l = _mm_loadu_ps(left + i);
+            __m128 r = _mm_loadu_ps(right + i);
+            _mm_storeu_ps(output + i * 2, _mm_unpacklo_ps(l, r));
+            _mm_storeu_ps(output + i * 2 + 4, _mm_unpackhi_ps(l, r));
+        #else
+            float32x4x2_t samples = { { vld1q_f32(left + i), vld1q_f32(right + i) } };
+            vst2q_f32(output + i * 2, samples);
+        #endif
+        }
+    }
+#endif
+
+    for (; i < n_samples; ++i)
+        for (int c = 0; c < n_channels; ++c)
+            output[i * n_channels + c] = inputs[c][i];
+}
+
+static void reduce_extrema(const float* samples, int n_samples, float* minimum, float* maximum)
+{
+    int i = 0;
+    float lowest = *minimum;
+    float highest = *maximum;
+
+#if defined(__SSE__) || defined(__ARM_NEON)
+    if (n_samples >= 4)
+    {
+        float lanes[2][4];
+
+    #if defined(__SSE__)
+        __m128 lows = _mm_set1_ps(lowest);
+        __m128 highs = _mm_set1_ps(highest);
+
+        for (; i + 4 <= n_samples; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(samples + i);
+            lows = _mm_min_ps(lows, x);
+            highs = _mm_max_ps(highs, x);
+        }
+
+        _mm_storeu_ps(lanes[0], lows);
+        _mm_storeu_ps(lanes[1], highs);
+    #else
+        float32x4_t lows = vdupq_n_f32(lowest);
+        float32x4_t highs = vdupq_n_f32(highest);
+
+        for (; i + 4 <= n_samples; i += 4)
+        {
+            float32x4_t x = vld1q_f32(samples + i);
+            lows = vminq_f32(lows, x);
+            highs = vmaxq_f32(highs, x);
+        }
+
+        vst1q_f32(lanes[0], lows);
+        vst1q_f32(lanes[1], highs);
+    #endif
+
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            lowest = lanes[0][lane] < lowest ? lanes[0][lane] : lowest;
+            highest = lanes[1][lane] > highest ? lanes[1][lane] : highest;
+        }
+    }
+#endif
+
+    for (; i < n_samples; ++i)
+    {
+        lowest = samples[i] < lowest ? samples[i] : lowest;
+        highest = samples[i] > highest ? samples[i] : highest;
+    }
+
+    *minimum = lowest;
+    *maximum = highest;
+}
+
+void simd_reduce_envelope(const float* samples, int n_samples, float* minimum, float* maximum, float* sum_squares)
+{
+    if (sum_squares == NULL)
+    {
+        reduce_extrema(samples, n_samples, minimum, maximum);
+        return;
+    }
+
+    int i = 0;
+    float lowest = *minimum;
+    float highest = *maximum;
+    float total = *sum_squares;
+
+#if defined(__SSE__) || defined(__ARM_NEON)
+    if (n_samples >= 4)
+    {
+        float lanes[3][4];
+
+    #if defined(__SSE__)
+        __m128 lows = _mm_set1_ps(lowest);
+        __m128 highs = _mm_set1_ps(highest);
+        __m128 totals = _mm_setzero_ps();
+
+        for (; i + 4 <= n_samples; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(samples + i);
+            lows = _mm_min_ps(lows, x);
+            highs = _mm_max_ps(highs, x);
+            totals = _mm_add_ps(totals, _mm_mul_ps(x, x));
+        }
+
+        _mm_storeu_ps(lanes[0], lows);
+        _mm_storeu_ps(lanes[1], highs);
+        _mm_storeu_ps(lanes[2], totals);
+    #else
+        float32x4_t lows = vdupq_n_f32(lowest);
+        float32x4_t highs = vdupq_n_f32(highest);
+        float32x4_t totals = vdupq_n_f32(0.0f);
+
+        for (; i + 4 <= n_samples; i += 4)
+        {
+            float32x4_t x = vld1q_f32(samples + i);
+            lows = vminq_f32(lows, x);
+            highs = vmaxq_f32(highs, x);
+            totals = vmlaq_f32(totals, x, x);
+        }
+
+        vst1q_f32(lanes[0], lows);
+        vst1q_f32(lanes[1], highs);
+        vst1q_f32(lanes[2], totals);
+    #endif
+
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            lowest = lanes[0][lane] < lowest ? lanes[0][lane] : lowest;
+            highest = lanes[1][lane] > highest ? lanes[1][lane] : highest;
+            total += lanes[2][lane];
+        }
+    }
+#endif
+
+    for (; i < n_samples; ++i)
+    {
+        lowest = samples[i] < lowest ? samples[i] : lowest;
+        highest = samples[i] > highest ? samples[i] : highest;
+        total += samples[i] * samples[i];
+    }
+
+    *minimum = lowest;
+    *maximum = highest;
+    *sum_squares = total;
+}
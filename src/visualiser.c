@@ -1,15 +1,145 @@
 #include "visualiser.h"
 #include "preferences.h"
+#include "simd.h"
 #include "common.h"
 #include <complex.h>
 #include <fftw3.h>
 
 #define FRAME_SIZE PACKET_SIZE
-#define N_FRAMES 5
+#define MAX_ANALYSER_SIZE 16384
+#define MAX_ANALYSER_BINS (MAX_ANALYSER_SIZE / 2 + 1)
+#define THREADED_ANALYSER_SIZE 8192
 
 static float* audio_data;
-static float* processed_frames[N_FRAMES] = {};
-static int current_frame = 0;
+static float* frame; // Latest samples, in the time domain
+
+// Prefix sum of the latest spectrum's magnitudes, so that any range of bins
+// is two lookups. Kept in doubles, as quiet treble bins would otherwise be
+// lost to rounding in the difference between two large running totals.
+static double* bin_sums;
+
+/*
+    The time domain shows a packet's worth of samples, but from somewhere in
+    the last two packets, so that the trigger can line each frame up with a
+    rising zero crossing. The hysteresis keeps noise around zero from
+    triggering it.
+*/
+#define TIME_DOMAIN_SCALE 5.0f
+#define TRIGGER_HYSTERESIS 0.01f
+
+static float* scope_samples; // [2 * FRAME_SIZE]
+
+/*
+    The spectrum is taken over a sliding window of the most recent samples,
+    independent of the packet size, so that the bass is not limited to 60 Hz
+    bins. Every "hop" samples, the window is copied out of the history ring,
+    multiplied by the window function and transformed. The plan is only
+    remade when the size changes; only ever executed from the GTK thread.
+*/
+static float* analyser_history;
+static int analyser_position = 0;       // Where the next sample is written
+static int analyser_pending = 0;        // Samples since the last analysis
+static float* analyser_input;
+static float* analyser_window;
+static fftwf_complex* fft_output = NULL;
+static fftwf_plan fft_plan = NULL;
+static int planned_size = 0;
+static AnalyserWindow planned_window;
+static bool planned_constant_q;
+
+// Which part of each frame a bar reads from (samples, in the time domain)
+typedef struct BarBins
+{
+    int min_bin;
+    int max_bin;
+    float weight; // 1 / number of bins, or 0 to hide the bar
+    int kernel_offset; // Constant-Q only; one coefficient per bin in range
+} BarBins;
+
+/*
+    In constant-Q mode, each bar is a windowed sinusoid whose length matches
+    the bar's bandwidth, correlated with the latest frame. That correlation is
+    done in the frequency domain, where each bar's kernel is only non-zero
+    near its own frequency, so only that span of coefficients is kept. Taken
+    over all bars, this amounts to a few passes over the spectrum.
+*/
+#define CONSTANT_Q_SPAN 3.0 // Kernel half-width, in main lobes of its window
+#define MINIMUM_KERNEL_SIZE 16
+
+static fftwf_complex* bar_kernels = NULL;
+static size_t n_kernel_coefficients = 0;
+static size_t kernel_capacity = 0;
+
+#define FADE_PATTERN_STOPS 32
+
+static BarBins* bar_table = NULL;
+static cairo_pattern_t* fade_pattern = NULL;
+
+// Bar geometry for the snapshot renderer; only the heights change per frame
+static graphene_rect_t* bar_rects = NULL;
+static GdkRGBA* bar_colours = NULL;
+static int n_bars = 0;
+static int n_levels = 0; // Time-domain bars have a top and a bottom
+static int bar_table_width = -1;
+
+/*
+    Smoothing happens as each frame arrives, so drawing costs the same however
+    long the window is. Each bar keeps a running sum over a ring of its recent
+    values, and the resulting mean is then eased towards with separate attack
+    and release rates. Everything is laid out bar by bar in one allocation.
+*/
+static float* bar_storage = NULL;
+static float* bar_history;  // [smoothing frames][n_levels]
+static float* bar_sums;     // [n_levels]
+static float* bar_levels;   // [n_levels], what is actually drawn
+static int history_position = 0;
+
+// Cached so that drawing doesn't have to go through GSettings
+static struct
+{
+    bool is_frequency_domain;
+    int gap_size;
+    bool fade_edges;
+    bool use_bark_scale;
+    float minimum_frequency;
+    float maximum_frequency;
+    float gain;
+    int smoothing_frames;
+    float attack_coefficient;
+    float release_coefficient;
+    int analyser_size;
+    AnalyserWindow analyser_window;
+    int analyser_hop;
+    bool use_constant_q;
+    bool is_spectrogram;
+    int spectrogram_history;
+    bool oscilloscope_trigger;
+} preferences;
+static bool preferences_changed = true; // Means rebuilding the bars
+static bool levels_changed = false;      // Only gain and smoothing rates
+
+/*
+    The spectrogram is a ring of columns in an image: each new column is
+    written over the oldest, and drawing is two blits either side of it, so
+    neither costs more with a longer history.
+*/
+#define MAX_SPECTROGRAM_COLUMNS 4096
+#define MAX_SPECTROGRAM_ROWS 1024
+#define SPECTROGRAM_LUT_SIZE 256
+
+static cairo_surface_t* spectrogram = NULL;
+static int spectrogram_columns = 0;
+static int spectrogram_column = 0;          // The next (and oldest) column
+static int spectrogram_frames_per_column = 1;
+static int spectrogram_frames = 0;          // Frames so far in this column
+static uint32_t spectrogram_lut[SPECTROGRAM_LUT_SIZE];
+
+// Multiplies bar heights, to fade out (and back in) on pause
+static float fade = 1.0f;
+static float fade_from = 1.0f;
+static gint64 fade_start_time = -1;
+static bool is_fading = false;
+static bool is_paused = false;
 
 static GdkRGBA mix_colours(const GdkRGBA* one, const GdkRGBA* two, float t)
 {
@@ -63,142 +193,701 @@ static int frequency_to_fft_index(float frequency)
     if (frequency < 0 || frequency > AUDIO_FREQUENCY / 2)
         g_warning_once("invalid frequency %f", frequency);
 
-    int index = (int)(frequency / (float)AUDIO_FREQUENCY * (float)FRAME_SIZE);
-    return MIN(index, FRAME_SIZE - 1);
+    int size = preferences.analyser_size;
+    int index = (int)(frequency / (float)AUDIO_FREQUENCY * (float)size);
+    return MIN(index, size / 2);
+}
+
+static float get_bin_average(const BarBins* bins)
+{
+    return (float)(bin_sums[bins->max_bin + 1] - bin_sums[bins->min_bin]) * bins->weight;
+}
+
+static float get_constant_q_value(const BarBins* bins)
+{
+    // Written out by hand to avoid C's (slow, NaN-aware) complex multiply
+    const float* kernel = (const float*)(bar_kernels + bins->kernel_offset);
+    const float* spectrum = (const float*)fft_output;
+    float real = 0.0f;
+    float imaginary = 0.0f;
+
+    for (int i = bins->min_bin; i <= bins->max_bin; ++i, kernel += 2)
+    {
+        float xr = spectrum[i * 2], xi = spectrum[i * 2 + 1];
+        real += xr * kernel[0] - xi * kernel[1];
+        imaginary += xr * kernel[1] + xi * kernel[0];
+    }
+
+    return sqrtf(real * real + imaginary * imaginary);
+}
+
+static void update_spectrogram_column()
+{
+    /*
+        Each column covers however many frames it takes to fit the requested
+        history into the image, keeping the loudest of them. Writing the
+        column is then one LUT lookup per row.
+    */
+    if (++spectrogram_frames < spectrogram_frames_per_column)
+        return;
+
+    uint8_t* data = cairo_image_surface_get_data(spectrogram);
+    int stride = cairo_image_surface_get_stride(spectrogram);
+    cairo_surface_flush(spectrogram);
+
+    for (int bar = 0; bar < n_bars; ++bar)
+    {
+        // Lowest frequencies at the bottom
+        float level = log10f(preferences.gain + bar_levels[bar]);
+        int index = (int)(CLAMP(level, 0.0f, 1.0f) * (SPECTROGRAM_LUT_SIZE - 1));
+
+        uint32_t* pixel = (uint32_t*)(data + (n_bars - 1 - bar) * stride) + spectrogram_column;
+        *pixel = spectrogram_lut[index];
+        bar_levels[bar] = 0.0f;
+    }
+
+    cairo_surface_mark_dirty_rectangle(spectrogram, spectrogram_column, 0, 1, n_bars);
+    spectrogram_column = (spectrogram_column + 1) % spectrogram_columns;
+    spectrogram_frames = 0;
+}
+
+static void smooth_level(int index, float value, float* history)
+{
+    // Swap the oldest value out of the window for the newest
+    bar_sums[index] += value - history[index];
+    history[index] = value;
+
+    float target = bar_sums[index] / (float)preferences.smoothing_frames;
+    float coefficient = target > bar_levels[index] ?
+        preferences.attack_coefficient : preferences.release_coefficient;
+    bar_levels[index] = target + coefficient * (bar_levels[index] - target);
+}
+
+static void update_bars()
+{
+    if (n_bars == 0) return;
+
+    // The spectrogram does its own smoothing, in a sense
+    if (preferences.is_spectrogram)
+    {
+        for (int bar = 0; bar < n_bars; ++bar)
+        {
+            const BarBins* bins = &bar_table[bar];
+            float value = preferences.use_constant_q ?
+                get_constant_q_value(bins) :
+                get_bin_average(bins);
+            bar_levels[bar] = MAX(bar_levels[bar], value);
+        }
+
+        update_spectrogram_column();
+        return;
+    }
+
+    float* history = bar_history + history_position * n_levels;
+
+    for (int bar = 0; bar < n_bars; ++bar)
+    {
+        const BarBins* bins = &bar_table[bar];
+
+        // Peaks of every sample under the bar, so nothing aliases; starting
+        // from zero keeps even a silent bar visible
+        if (!preferences.is_frequency_domain)
+        {
+            float minimum = 0.0f;
+            float maximum = 0.0f;
+            int n_samples = bins->max_bin - bins->min_bin + 1;
+            simd_reduce_envelope(frame + bins->min_bin, n_samples, &minimum, &maximum, NULL);
+
+            smooth_level(bar, maximum, history);
+            smooth_level(n_bars + bar, minimum, history);
+            continue;
+        }
+
+        // Average each "bin"
+        float value = preferences.use_constant_q ?
+            get_constant_q_value(bins) :
+            get_bin_average(bins);
+        smooth_level(bar, value, history);
+    }
+
+    history_position = (history_position + 1) % preferences.smoothing_frames;
+
+    // Stop rounding errors from building up in the running sums
+    if (history_position == 0)
+    {
+        memset(bar_sums, 0, sizeof(float) * n_levels);
+        for (int i = 0; i < preferences.smoothing_frames; ++i)
+            for (int level = 0; level < n_levels; ++level)
+                bar_sums[level] += bar_history[i * n_levels + level];
+    }
+}
+
+static fftwf_plan plan_analyser(int size, bool may_measure)
+{
+    /*
+        Measuring a big transform can take long enough to drop frames, so
+        once running, only wisdom that's already been measured is used and
+        anything else is planned by estimate instead.
+    */
+    unsigned int flags = may_measure ? FFTW_MEASURE : FFTW_MEASURE | FFTW_WISDOM_ONLY;
+    fftwf_plan plan = fftwf_plan_dft_r2c_1d(size, analyser_input, fft_output, flags);
+    if (plan == NULL)
+        plan = fftwf_plan_dft_r2c_1d(size, analyser_input, fft_output, FFTW_ESTIMATE);
+    return plan;
+}
+
+static void update_analyser(bool may_measure)
+{
+    int size = preferences.analyser_size;
+    if (size == planned_size &&
+        preferences.analyser_window == planned_window &&
+        preferences.use_constant_q == planned_constant_q)
+        return;
+
+    if (size != planned_size)
+    {
+        if (fft_plan != NULL)
+            fftwf_destroy_plan(fft_plan);
+
+        // Big transforms are worth spreading over a couple of threads
+#ifdef HAVE_FFTW_THREADS
+        fftwf_plan_with_nthreads(size >= THREADED_ANALYSER_SIZE ? 2 : 1);
+#endif
+        fft_plan = plan_analyser(size, may_measure);
+#ifdef HAVE_FFTW_THREADS
+        fftwf_plan_with_nthreads(1);
+#endif
+    }
+
+    /*
+        Scale the window so that a sine wave comes out at the same magnitude as
+        it did back when a packet was transformed as-is, rather than growing
+        with the analyser size and shrinking with the window's taper.
+    */
+    float sum = 0.0f;
+    for (int i = 0; i < size && !preferences.use_constant_q; ++i)
+    {
+        float x = 2.0f * G_PI * (float)i / (float)size;
+        analyser_window[i] = preferences.analyser_window == ANALYSER_WINDOW_BLACKMAN ?
+            0.42f - 0.5f * cosf(x) + 0.08f * cosf(2.0f * x) :
+            0.5f - 0.5f * cosf(x);
+        sum += analyser_window[i];
+    }
+    for (int i = 0; i < size && !preferences.use_constant_q; ++i)
+        analyser_window[i] *= (float)FRAME_SIZE / sum;
+
+    // Constant-Q kernels bring their own windows (and scaling)
+    for (int i = 0; i < size && preferences.use_constant_q; ++i)
+        analyser_window[i] = 1.0f;
+
+    planned_size = size;
+    planned_window = preferences.analyser_window;
+    planned_constant_q = preferences.use_constant_q;
 }
 
 static void add_fft_frame()
 {
-    float* buffer = fftwf_alloc_real(FRAME_SIZE);
-    fftwf_complex* fft_output = fftwf_alloc_complex(FRAME_SIZE);
+    int size = preferences.analyser_size;
+    update_analyser(false);
 
-    // Feed input audio
-    for (int i = 0; i < FRAME_SIZE; ++i)
-        buffer[i] = audio_data[i];
+    // Unwrap the last "size" samples from the history, windowing as we go
+    int start = (analyser_position - size + MAX_ANALYSER_SIZE) % MAX_ANALYSER_SIZE;
+    int first = MIN(size, MAX_ANALYSER_SIZE - start);
+    for (int i = 0; i < first; ++i)
+        analyser_input[i] = analyser_history[start + i] * analyser_window[i];
+    for (int i = first; i < size; ++i)
+        analyser_input[i] = analyser_history[i - first] * analyser_window[i];
 
     // Perform DFT
-    fftwf_plan plan = fftwf_plan_dft_r2c_1d(
-        FRAME_SIZE,
-        buffer,
-        fft_output,
-        FFTW_ESTIMATE
-    );
-    fftwf_execute_dft_r2c(plan, buffer, fft_output);
+    fftwf_execute(fft_plan);
 
-    // Add to frame
-    for (int i = 0; i < FRAME_SIZE; ++i)
-        processed_frames[current_frame][i] = cabsf(fft_output[i]);
-    current_frame = (current_frame + 1) % N_FRAMES;
+    if (!preferences.use_constant_q)
+    {
+        bin_sums[0] = 0.0;
+        for (int i = 0; i < size / 2 + 1; ++i)
+            bin_sums[i + 1] = bin_sums[i] + (double)cabsf(fft_output[i]);
+    }
 
-    // Free
-    fftwf_destroy_plan(plan);
-    fftwf_free(buffer);
-    fftwf_free(fft_output);
+    update_bars();
+}
+
+static void add_fft_frames(const float* samples, int n_samples)
+{
+    while (n_samples > 0)
+    {
+        // Copy up to the next hop (or the end of the ring)
+        int count = MIN(n_samples, preferences.analyser_hop - analyser_pending);
+        count = MIN(count, MAX_ANALYSER_SIZE - analyser_position);
+        memcpy(analyser_history + analyser_position, samples, sizeof(float) * count);
+
+        analyser_position = (analyser_position + count) % MAX_ANALYSER_SIZE;
+        analyser_pending += count;
+        samples += count;
+        n_samples -= count;
+
+        if (analyser_pending >= preferences.analyser_hop)
+        {
+            add_fft_frame();
+            analyser_pending = 0;
+        }
+    }
+}
+
+static int find_trigger()
+{
+    // The latest place a whole frame can start on a rising zero crossing
+    int trigger = FRAME_SIZE;
+    bool is_armed = false;
+
+    for (int i = 0; i <= FRAME_SIZE; ++i)
+    {
+        if (scope_samples[i] < -TRIGGER_HYSTERESIS)
+            is_armed = true;
+        else if (is_armed && scope_samples[i] >= 0.0f)
+        {
+            trigger = i;
+            is_armed = false;
+        }
+    }
+
+    return trigger;
 }
 
 static void add_time_domain_frame()
 {
-    // Add to frame, but take absolute value as audio is signed
-    for (int i = 0; i < FRAME_SIZE; ++i)
-        processed_frames[current_frame][i] = fabs(audio_data[i]);
-    current_frame = (current_frame + 1) % N_FRAMES;
+    memmove(scope_samples, scope_samples + FRAME_SIZE, sizeof(float) * FRAME_SIZE);
+    memcpy(scope_samples + FRAME_SIZE, audio_data, sizeof(float) * FRAME_SIZE);
+
+    // Without the trigger, just show the latest packet
+    int start = preferences.oscilloscope_trigger ? find_trigger() : FRAME_SIZE;
+    memcpy(frame, scope_samples + start, sizeof(float) * FRAME_SIZE);
+
+    update_bars();
 }
 
-static float get_bar_height_from_fft(
-    float* frame,
-    float minimum_frequency,
-    float maximum_frequency,
-    float progress,
-    float progress_step,
-    bool use_bark_scale
-)
+static float get_smoothing_coefficient(int milliseconds)
 {
-    int min_index, max_index;
+    // Fraction of the gap left after one frame; 0 means no smoothing at all
+    if (milliseconds <= 0) return 0.0f;
+    int frame_samples = preferences.is_frequency_domain ? preferences.analyser_hop : FRAME_SIZE;
+    float frame_milliseconds = 1000.0f * (float)frame_samples / (float)AUDIO_FREQUENCY;
+    return expf(-frame_milliseconds / (float)milliseconds);
+}
 
-    // Incoming frequencies are in whatever scale we want to use
-    float frequency_range = maximum_frequency - minimum_frequency;
-    float min_frequency = minimum_frequency + frequency_range * progress;
-    float max_frequency = minimum_frequency + frequency_range * (progress + progress_step);
+/*
+    Settings that change which bars there are (or what they read from) mean
+    rebuilding them and starting their history afresh, whereas the rest only
+    matter as levels are smoothed and drawn. Between them, these are every
+    key that update_preferences and update_level_preferences read.
+*/
+static const char* const layout_keys[] = {
+    "visualisation-type",
+    "spectrogram-history",
+    "oscilloscope-trigger",
+    "gap-size",
+    "fade-edges",
+    "use-bark-scale",
+    "minimum-frequency",
+    "maximum-frequency",
+    "smoothing-frames",
+    "analyser-size",
+    "analyser-window",
+    "analyser-hop",
+    "use-constant-q"
+};
+
+static const char* const level_keys[] = {
+    "gain",
+    "smoothing-attack",
+    "smoothing-release"
+};
+
+static bool is_key_in(const char* key, const char* const* keys, size_t n_keys)
+{
+    for (size_t i = 0; i < n_keys; ++i)
+        if (strcmp(key, keys[i]) == 0)
+            return true;
+    return false;
+}
+
+static void update_level_preferences()
+{
+    preferences.gain = preferences_get_gain();
+    preferences.attack_coefficient = get_smoothing_coefficient(preferences_get_smoothing_attack());
+    preferences.release_coefficient = get_smoothing_coefficient(preferences_get_smoothing_release());
+    levels_changed = false;
+}
+
+static void update_preferences()
+{
+    VisualisationType type = preferences_get_visualisation_type();
+    preferences.is_frequency_domain = type != VISUALISATION_TYPE_TIME_DOMAIN;
+    preferences.is_spectrogram = type == VISUALISATION_TYPE_SPECTROGRAM;
+    preferences.spectrogram_history = preferences_get_spectrogram_history();
+    preferences.oscilloscope_trigger = preferences_get_oscilloscope_trigger();
+    preferences.gap_size = preferences_get_gap_size();
+    preferences.fade_edges = preferences_get_fade_edges();
+    preferences.use_bark_scale = preferences_get_use_bark_scale();
+    preferences.minimum_frequency = preferences_get_minimum_frequency();
+    preferences.maximum_frequency = preferences_get_maximum_frequency();
+    preferences.smoothing_frames = preferences_get_smoothing_frames();
+    preferences.analyser_size = preferences_get_analyser_size();
+    preferences.analyser_window = preferences_get_analyser_window();
+    preferences.analyser_hop = preferences_get_analyser_hop();
+    preferences.use_constant_q = preferences_get_use_constant_q();
+    preferences_changed = false;
+
+    // The smoothing rates depend on how often frames arrive
+    update_level_preferences();
 
-    if (!use_bark_scale)
+    // The bar mapping (and so the smoothing history) depends on the above,
+    // so stop using it until the next draw rebuilds it
+    bar_table_width = -1;
+    n_bars = 0;
+}
+
+static void apply_preference_changes()
+{
+    if (preferences_changed)
+        update_preferences();
+    else if (levels_changed)
+        update_level_preferences();
+}
+
+static void build_fade_pattern(int width)
+{
+    GdkRGBA background_colour = get_background_colour();
+    GdkRGBA base_bar_colour = get_base_bar_colour();
+
+    // Approximate the fade (a sine curve) with enough stops to look smooth
+    if (fade_pattern != NULL)
+        cairo_pattern_destroy(fade_pattern);
+    fade_pattern = cairo_pattern_create_linear(0.0, 0.0, (double)width, 0.0);
+
+    for (int i = 0; i <= FADE_PATTERN_STOPS; ++i)
     {
-        // Pick range in Hertz scale directly
-        min_index = frequency_to_fft_index(min_frequency);
-        max_index = frequency_to_fft_index(max_frequency);
+        float progress = (float)i / (float)FADE_PATTERN_STOPS;
+        float mix_amount = 1.0f - sinf(G_PI * progress);
+        GdkRGBA colour = mix_colours(&base_bar_colour, &background_colour, mix_amount);
+        cairo_pattern_add_color_stop_rgba(
+            fade_pattern,
+            progress,
+            colour.red,
+            colour.green,
+            colour.blue,
+            colour.alpha
+        );
     }
-    else
+}
+
+static void build_spectrogram()
+{
+    // Enough columns for the history, or as close as the image allows
+    int frames_per_second = AUDIO_FREQUENCY / preferences.analyser_hop;
+    int frames = MAX(preferences.spectrogram_history * frames_per_second, 1);
+    spectrogram_frames_per_column = (frames + MAX_SPECTROGRAM_COLUMNS - 1) / MAX_SPECTROGRAM_COLUMNS;
+    spectrogram_columns = frames / spectrogram_frames_per_column;
+    spectrogram_column = 0;
+    spectrogram_frames = 0;
+
+    if (spectrogram != NULL)
+        cairo_surface_destroy(spectrogram);
+    spectrogram = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, spectrogram_columns, MAX(n_bars, 1));
+
+    // Fade in the bar colour (premultiplied), which CSS then recolours
+    GdkRGBA colour = get_base_bar_colour();
+    for (int i = 0; i < SPECTROGRAM_LUT_SIZE; ++i)
     {
-        // Picked range was in Bark scale; go back to Hertz
-        float min_index_hertz = bark_to_hertz_scale(min_frequency);
-        float max_index_hertz = bark_to_hertz_scale(max_frequency);
-        min_index = frequency_to_fft_index(min_index_hertz);
-        max_index = frequency_to_fft_index(max_index_hertz);
+        float alpha = colour.alpha * (float)i / (float)(SPECTROGRAM_LUT_SIZE - 1);
+        spectrogram_lut[i] =
+            (uint32_t)(alpha * 255.0f) << 24 |
+            (uint32_t)(colour.red * alpha * 255.0f) << 16 |
+            (uint32_t)(colour.green * alpha * 255.0f) << 8 |
+            (uint32_t)(colour.blue * alpha * 255.0f);
     }
+}
 
-#if BARK_SCALE_HIDE_ADJACENT_BARS
-    // If the resolution is such that adjacent bars will be of the
-    // same index (e.g. at the lower end of frequencies), only
-    // draw a single bar instead of a whole ugly "block"
-    if (use_bark_scale && min_index == max_index)
-        return 0.0f;
-#endif
+static void draw_spectrogram(cairo_t* cairo, int width, int height)
+{
+    int newest = spectrogram_column;
+    int oldest = spectrogram_columns - newest;
+
+    cairo_save(cairo);
+    cairo_scale(cairo, (double)width / spectrogram_columns, (double)height / n_bars);
+
+    // Oldest columns (from the write position onwards) on the left...
+    cairo_set_source_surface(cairo, spectrogram, -newest, 0.0);
+    cairo_rectangle(cairo, 0.0, 0.0, oldest, n_bars);
+    cairo_fill(cairo);
 
-    // Average each "bin"
-    float total = 0;
-    for (int i = min_index; i <= max_index; ++i)
-        total += frame[i];
+    // ...and then the newest (wrapped around to the start) on the right
+    cairo_set_source_surface(cairo, spectrogram, oldest, 0.0);
+    cairo_rectangle(cairo, oldest, 0.0, newest, n_bars);
+    cairo_fill(cairo);
 
-    return total / (float)(max_index - min_index + 1);
+    cairo_restore(cairo);
 }
 
-static float get_bar_height(
-    float progress,
-    float progress_step,
-    float minimum_frequency,
-    float maximum_frequency,
-    float gain,
-    float height,
-    bool use_bark_scale,
-    bool is_frequency_domain
-)
+static double complex get_dirichlet_kernel(double phase, int length)
+{
+    // Sum of e^(-i * phase * n) for n in [0, length)
+    double denominator = sin(phase / 2.0);
+    double magnitude = fabs(denominator) < 1e-9 ?
+        (double)length : sin((double)length * phase / 2.0) / denominator;
+    return magnitude * cexp(-I * phase * (double)(length - 1) / 2.0);
+}
+
+static void add_constant_q_kernel(BarBins* bins, float min_frequency, float max_frequency)
+{
+    /*
+        The bar is a Hann-windowed complex sinusoid at its centre frequency,
+        just long enough to resolve its own bandwidth, and placed at the end
+        of the frame so it sees the newest audio. Its spectrum has a closed
+        form (three shifted Dirichlet kernels), so no transforms are needed.
+    */
+    int size = preferences.analyser_size;
+    double centre = 0.5 * (min_frequency + max_frequency);
+    double bandwidth = MAX(max_frequency - min_frequency, 1e-3);
+    int length = (int)(2.0 * AUDIO_FREQUENCY / bandwidth);
+    length = CLAMP(length, MINIMUM_KERNEL_SIZE, size);
+
+    double omega = 2.0 * G_PI * centre / AUDIO_FREQUENCY;
+    double offset = (double)(size - length);
+    double peak = centre / AUDIO_FREQUENCY * size;
+    double span = CONSTANT_Q_SPAN * 2.0 * size / length;
+
+    bins->min_bin = CLAMP((int)floor(peak - span), 0, size / 2);
+    bins->max_bin = CLAMP((int)ceil(peak + span), 0, size / 2);
+    bins->weight = 1.0f;
+    bins->kernel_offset = (int)n_kernel_coefficients;
+
+    int count = bins->max_bin - bins->min_bin + 1;
+    if (n_kernel_coefficients + count > kernel_capacity)
+    {
+        kernel_capacity = MAX(kernel_capacity * 2, n_kernel_coefficients + count);
+        bar_kernels = realloc(bar_kernels, sizeof(fftwf_complex) * kernel_capacity);
+    }
+
+    /*
+        By Parseval, correlating in time is (1 / size) times correlating the
+        spectra. Also scale so that a sine wave has the same height as with
+        the plain FFT, like the analyser window does (a Hann window sums to
+        half its length).
+    */
+    double scale = (double)FRAME_SIZE / (0.5 * length) / (double)size;
+    double step = 2.0 * G_PI / length;
+
+    for (int i = 0; i < count; ++i)
+    {
+        double phase = 2.0 * G_PI * (bins->min_bin + i) / size - omega;
+        double complex window =
+            0.5 * get_dirichlet_kernel(phase, length) -
+            0.25 * get_dirichlet_kernel(phase - step, length) -
+            0.25 * get_dirichlet_kernel(phase + step, length);
+
+        // Stored conjugated, ready to multiply the spectrum by
+        double complex coefficient = cexp(-I * phase * offset) * window * scale;
+        bar_kernels[n_kernel_coefficients + i] = (float complex)conj(coefficient);
+    }
+
+    n_kernel_coefficients += count;
+}
+
+static void build_bar_table(int width)
 {
-    if (is_frequency_domain)
+    // The spectrogram has a "bar" for each row of pixels instead
+    int gap_size = preferences.is_spectrogram ? 1 : preferences.gap_size;
+
+    free(bar_table);
+    n_bars = (width + gap_size - 1) / gap_size;
+    bar_table = malloc(sizeof(BarBins) * MAX(n_bars, 1));
+    bar_table_width = width;
+
+    build_fade_pattern(width);
+
+    // Likewise for the snapshot renderer, where each bar is its own node
+    GdkRGBA background_colour = get_background_colour();
+    GdkRGBA base_bar_colour = get_base_bar_colour();
+    free(bar_rects);
+    free(bar_colours);
+    bar_rects = malloc(sizeof(graphene_rect_t) * MAX(n_bars, 1));
+    bar_colours = malloc(sizeof(GdkRGBA) * MAX(n_bars, 1));
+
+    for (int bar = 0; bar < n_bars; ++bar)
     {
-        float total = 0.0f;
-        for (int i = 0; i < N_FRAMES; ++i)
+        int i = bar * gap_size;
+        float progress = (float)i / (float)width;
+        graphene_rect_init(&bar_rects[bar], (float)i, 0.0f, 1.0f, 0.0f);
+
+        if (preferences.fade_edges)
+        {
+            float mix_amount = 1.0f - sinf(G_PI * progress);
+            bar_colours[bar] = mix_colours(&base_bar_colour, &background_colour, mix_amount);
+        }
+        else
+            bar_colours[bar] = base_bar_colour;
+    }
+
+    if (preferences.is_spectrogram)
+        build_spectrogram();
+
+    // Start smoothing afresh
+    n_levels = preferences.is_frequency_domain ? n_bars : n_bars * 2;
+    free(bar_storage);
+    bar_storage = calloc((size_t)n_levels * (preferences.smoothing_frames + 2) + 1, sizeof(float));
+    bar_history = bar_storage;
+    bar_sums = bar_history + n_levels * preferences.smoothing_frames;
+    bar_levels = bar_sums + n_levels;
+    history_position = 0;
+
+    // Incoming frequencies are in whatever scale we want to use
+    bool use_constant_q = preferences.use_constant_q && preferences.is_frequency_domain;
+    bool use_log_scale = use_constant_q && !preferences.use_bark_scale;
+    float minimum_frequency = preferences.minimum_frequency;
+    float maximum_frequency = preferences.maximum_frequency;
+    if (preferences.use_bark_scale)
+    {
+        minimum_frequency = hertz_to_bark_scale(minimum_frequency);
+        maximum_frequency = hertz_to_bark_scale(maximum_frequency);
+    }
+    else if (use_log_scale)
+    {
+        minimum_frequency = logf(minimum_frequency);
+        maximum_frequency = logf(maximum_frequency);
+    }
+    n_kernel_coefficients = 0;
+
+    float frequency_range = maximum_frequency - minimum_frequency;
+    float progress_step = (float)gap_size / (float)width;
+
+    for (int bar = 0; bar < n_bars; ++bar)
+    {
+        float progress = (float)(bar * gap_size) / (float)width;
+        BarBins* bins = &bar_table[bar];
+
+        if (!preferences.is_frequency_domain)
+        {
+            // Every sample up to the next bar (at least one, when zoomed in)
+            int first = (int)(progress * (float)FRAME_SIZE);
+            int last = (int)((progress + progress_step) * (float)FRAME_SIZE) - 1;
+            bins->min_bin = CLAMP(first, 0, FRAME_SIZE - 1);
+            bins->max_bin = CLAMP(last, bins->min_bin, FRAME_SIZE - 1);
+            bins->weight = 1.0f;
+            continue;
+        }
+
+        float min_frequency = minimum_frequency + frequency_range * progress;
+        float max_frequency = minimum_frequency + frequency_range * (progress + progress_step);
+
+        // Picked range was in Bark (or log) scale; go back to Hertz
+        if (preferences.use_bark_scale)
+        {
+            min_frequency = bark_to_hertz_scale(min_frequency);
+            max_frequency = bark_to_hertz_scale(max_frequency);
+        }
+        else if (use_log_scale)
+        {
+            min_frequency = expf(min_frequency);
+            max_frequency = expf(max_frequency);
+        }
+
+        if (use_constant_q)
         {
-            total += get_bar_height_from_fft(
-                processed_frames[i],
-                minimum_frequency,
-                maximum_frequency,
-                progress,
-                progress_step,
-                use_bark_scale
-            );
+            add_constant_q_kernel(bins, min_frequency, max_frequency);
+            continue;
         }
-        total /= (float)N_FRAMES;
 
+        bins->min_bin = frequency_to_fft_index(min_frequency);
+        bins->max_bin = frequency_to_fft_index(max_frequency);
+        bins->weight = 1.0f / (float)(bins->max_bin - bins->min_bin + 1);
+
+#if BARK_SCALE_HIDE_ADJACENT_BARS
+        // If the resolution is such that adjacent bars will be of the
+        // same index (e.g. at the lower end of frequencies), only
+        // draw a single bar instead of a whole ugly "block"
+        if (preferences.use_bark_scale && bins->min_bin == bins->max_bin)
+            bins->weight = 0.0f;
+#endif
+    }
+}
+
+static float get_bar_height(float level, float height)
+{
+    height *= fade;
+
+    if (preferences.is_frequency_domain)
+    {
         // Scale logarithmically
-        total = log10f(gain + total);
-        total *= (float)height;
-        return total;
+        return log10f(preferences.gain + level) * height;
     }
     else
     {
-        int index = (int)(progress * (float)FRAME_SIZE);
-        index = MIN(MAX(index, 0), FRAME_SIZE - 1);
+        // Map from [-1, 1] to either side of the middle, boosted as most
+        // audio is nowhere near full scale
+        return level * TIME_DOMAIN_SCALE * height / 2.0f;
+    }
+}
+
+static void get_bar_extent(int bar, float height, float* top, float* bar_height)
+{
+    if (preferences.is_frequency_domain)
+    {
+        *bar_height = get_bar_height(bar_levels[bar], height);
+        *top = height - *bar_height - 1.0f;
+        return;
+    }
 
-        // Average raw audio samples over N frames
-        float total = 0.0f;
-        for (int i = 0; i < N_FRAMES; ++i)
-            total += processed_frames[i][index];
-        total /= (float)N_FRAMES;
+    // From the envelope's highest point down to its lowest
+    float maximum = get_bar_height(bar_levels[bar], height);
+    float minimum = get_bar_height(bar_levels[n_bars + bar], height);
+    *top = height / 2.0f - maximum;
+    *bar_height = MAX(maximum - minimum, 1.0f);
+}
+
+static void prepare_bars(int width, int height)
+{
+    // Bars are updated as audio arrives (see visualiser_set_data), and the
+    // mapping from bars to frames only changes with the settings or the size
+    apply_preference_changes();
 
-        // Map from [-1, 1] to [0, height]
-        float scale = 10.0f;
-        float bar_height = total / 2.0f * (float)height;
-        bar_height *= scale;
-        return bar_height;
+    // Spectrogram rows go up the height instead
+    int length = preferences.is_spectrogram ? MIN(height, MAX_SPECTROGRAM_ROWS) : width;
+    if (length != bar_table_width)
+        build_bar_table(length);
+}
+
+static void append_bars(GtkSnapshot* snapshot, int width, int height)
+{
+    prepare_bars(width, height);
+
+    if (preferences.is_spectrogram)
+    {
+        // Already an image, so just hand it over to Cairo
+        graphene_rect_t bounds;
+        graphene_rect_init(&bounds, 0.0f, 0.0f, (float)width, (float)height);
+        cairo_t* cairo = gtk_snapshot_append_cairo(snapshot, &bounds);
+        if (n_bars > 0)
+            draw_spectrogram(cairo, width, height);
+        cairo_destroy(cairo);
+        return;
+    }
+
+    for (int bar = 0; bar < n_bars; ++bar)
+    {
+        float top, bar_height;
+        get_bar_extent(bar, (float)height, &top, &bar_height);
+
+        // Same as the Cairo version, where negative heights grow downwards
+        graphene_rect_t* rect = &bar_rects[bar];
+        rect->origin.y = top;
+        rect->size.height = bar_height;
+        if (bar_height < 0.0f)
+        {
+            rect->origin.y += bar_height;
+            rect->size.height = -bar_height;
+        }
+
+        gtk_snapshot_append_color(snapshot, &bar_colours[bar], rect);
     }
 }
 
@@ -210,62 +899,219 @@ void visualiser_draw_function(
     gpointer
 )
 {
-    bool is_frequency_domain =
-        preferences_get_visualisation_type() == VISUALISATION_TYPE_FREQUENCY_DOMAIN;
+    prepare_bars(width, height);
+
+    if (preferences.is_spectrogram)
+    {
+        if (n_bars > 0)
+            draw_spectrogram(cairo, width, height);
+        return;
+    }
 
-    if (is_frequency_domain)
-        add_fft_frame();
+    // Colour
+    if (preferences.fade_edges)
+        cairo_set_source(cairo, fade_pattern);
     else
-        add_time_domain_frame();
+    {
+        GdkRGBA base_bar_colour = get_base_bar_colour();
+        gdk_cairo_set_source_rgba(cairo, &base_bar_colour);
+    }
 
-    // Drawing settings
-    GdkRGBA background_colour = get_background_colour();
-    GdkRGBA base_bar_colour = get_base_bar_colour();
-    int step_size = preferences_get_gap_size();
-    bool fade_edges = preferences_get_fade_edges();
+    // Build every bar into the one path so that Cairo only has to fill once
+    for (int bar = 0; bar < n_bars; ++bar)
+    {
+        int i = bar * preferences.gap_size;
+        float top, bar_height;
+        get_bar_extent(bar, (float)height, &top, &bar_height);
+        cairo_rectangle(cairo, i, top, 1.0f, bar_height);
+    }
+    cairo_fill(cairo);
+}
+
+bool visualiser_setting_changed(const char* key)
+{
+    if (is_key_in(key, layout_keys, G_N_ELEMENTS(layout_keys)))
+        preferences_changed = true;
+    else if (is_key_in(key, level_keys, G_N_ELEMENTS(level_keys)))
+        levels_changed = true;
+    else
+        return false;
+    return true;
+}
+
+void visualiser_set_paused(bool paused)
+{
+    if (paused == is_paused) return;
+    is_paused = paused;
 
-    // FFT settings
-    bool use_bark_scale = preferences_get_use_bark_scale();
-    float minimum_frequency = preferences_get_minimum_frequency();
-    float maximum_frequency = preferences_get_maximum_frequency();
-    if (use_bark_scale)
+    // Starts from wherever the last fade got to, on the next frame
+    fade_from = fade;
+    fade_start_time = -1;
+    is_fading = true;
+}
+
+bool visualiser_animate(gint64 frame_time)
+{
+    if (!is_fading) return false;
+
+    if (fade_start_time < 0)
+        fade_start_time = frame_time;
+
+    float target = is_paused ? 0.0f : 1.0f;
+    float t = (float)(frame_time - fade_start_time) / (FADE_DURATION_MS * 1000.0f);
+    if (t >= 1.0f)
     {
-        minimum_frequency = hertz_to_bark_scale(minimum_frequency);
-        maximum_frequency = hertz_to_bark_scale(maximum_frequency);
+        fade = target;
+        is_fading = false;
+    }
+    else
+    {
+        // Ease in and out
+        t = t * t * (3.0f - 2.0f * t);
+        fade = fade_from + (target - fade_from) * t;
     }
-    float progress_step = (float)step_size / (float)width;
-    float gain = preferences_get_gain();
 
-    for (int i = 0; i < width; i += step_size)
+    return true;
+}
+
+/*
+    Alternative to the drawing area that hands GTK a render node per bar
+    rather than a Cairo surface, so that a GPU renderer can draw the bars
+    itself (and the Cairo renderer still works without one).
+*/
+struct _WaveformVisualiser
+{
+    GtkWidget parent_instance;
+};
+
+G_DEFINE_FINAL_TYPE(WaveformVisualiser, waveform_visualiser, GTK_TYPE_WIDGET)
+
+static void waveform_visualiser_snapshot(GtkWidget* widget, GtkSnapshot* snapshot)
+{
+    int width = gtk_widget_get_width(widget);
+    int height = gtk_widget_get_height(widget);
+    if (width <= 0 || height <= 0) return;
+
+    append_bars(snapshot, width, height);
+}
+
+static void waveform_visualiser_class_init(WaveformVisualiserClass* class)
+{
+    GTK_WIDGET_CLASS(class)->snapshot = waveform_visualiser_snapshot;
+}
+
+static void waveform_visualiser_init(WaveformVisualiser* self)
+{
+    gtk_widget_set_hexpand(GTK_WIDGET(self), true);
+    gtk_widget_set_vexpand(GTK_WIDGET(self), true);
+}
+
+GtkWidget* waveform_visualiser_new()
+{
+    return g_object_new(WAVEFORM_TYPE_VISUALISER, NULL);
+}
+
+static double benchmark_snapshot(GskRenderer* renderer, int width, int height, int n_frames)
+{
+    graphene_rect_t viewport;
+    graphene_rect_init(&viewport, 0.0f, 0.0f, (float)width, (float)height);
+
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < n_frames; ++i)
     {
-        // Position in frame
-        float progress = (float)i / (float)width;
+        GtkSnapshot* snapshot = gtk_snapshot_new();
+        append_bars(snapshot, width, height);
+        GskRenderNode* node = gtk_snapshot_free_to_node(snapshot);
 
-        // Sample frame(s)
-        float bar_height = get_bar_height(
-            progress,
-            progress_step,
-            minimum_frequency,
-            maximum_frequency,
-            gain,
-            height,
-            use_bark_scale,
-            is_frequency_domain
-        );
+        GdkTexture* texture = gsk_renderer_render_texture(renderer, node, &viewport);
+        g_object_unref(texture);
+        gsk_render_node_unref(node);
+    }
+
+    return (double)(g_get_monotonic_time() - start) / 1000.0 / (double)n_frames;
+}
+
+static void use_benchmark_preferences()
+{
+    // Whatever the user has saved, time the worst case: a bar (and so a
+    // render node) for every column, faded at the edges
+    apply_preference_changes();
+    preferences.is_frequency_domain = true;
+    preferences.is_spectrogram = false;
+    preferences.gap_size = 1;
+    preferences.fade_edges = true;
+    preferences.use_constant_q = false;
+    bar_table_width = -1;
+    n_bars = 0;
+}
+
+void visualiser_benchmark(int width, int height, int n_frames)
+{
+    // Set up just as the playback page would, but off-screen
+    GtkWidget* widget = g_object_ref_sink(waveform_visualiser_new());
+    visualiser_init(widget);
+    use_benchmark_preferences();
+
+    // Random, but not changing, bars
+    prepare_bars(width, height);
+    for (int bar = 0; bar < n_bars; ++bar)
+        bar_levels[bar] = (float)g_random_double_range(0.0, 10.0);
+
+    // Cairo draw function, onto an image surface like a drawing area would
+    cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_t* cairo = cairo_create(surface);
+
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < n_frames; ++i)
+    {
+        cairo_save(cairo);
+        cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
+        cairo_paint(cairo);
+        cairo_restore(cairo);
+        visualiser_draw_function(NULL, cairo, width, height, NULL);
+    }
+    cairo_surface_flush(surface);
+    double cairo_time = (double)(g_get_monotonic_time() - start) / 1000.0 / (double)n_frames;
+
+    cairo_destroy(cairo);
+    cairo_surface_destroy(surface);
+    g_print("cairo draw function:      %.3f ms/frame\n", cairo_time);
+
+    // Render nodes, through each renderer that is available here
+    struct { const char* name; GskRenderer* renderer; } renderers[] = {
+        { "snapshot (cairo renderer)", gsk_cairo_renderer_new() },
+        { "snapshot (gl renderer)",    gsk_gl_renderer_new() }
+    };
 
-        // Colour
-        if (fade_edges)
+    for (size_t i = 0; i < G_N_ELEMENTS(renderers); ++i)
+    {
+        GError* error = NULL;
+#if GTK_CHECK_VERSION(4, 14, 0)
+        bool is_realized = gsk_renderer_realize_for_display(
+            renderers[i].renderer,
+            gdk_display_get_default(),
+            &error
+        );
+#else
+        bool is_realized = gsk_renderer_realize(renderers[i].renderer, NULL, &error);
+#endif
+        if (!is_realized)
         {
-            float mix_amount = 1.0f - sinf(G_PI * progress);
-            GdkRGBA colour = mix_colours(&base_bar_colour, &background_colour, mix_amount);
-            gdk_cairo_set_source_rgba(cairo, &colour);
+            g_print("%s: unavailable (%s)\n", renderers[i].name, error->message);
+            g_error_free(error);
+            g_object_unref(renderers[i].renderer);
+            continue;
         }
-        else
-            gdk_cairo_set_source_rgba(cairo, &base_bar_colour);
 
-        cairo_rectangle(cairo, i, height - bar_height - 1.0f, 1.0f, bar_height);
-        cairo_fill(cairo);
+        double time = benchmark_snapshot(renderers[i].renderer, width, height, n_frames);
+        g_print("%s: %.3f ms/frame\n", renderers[i].name, time);
+
+        gsk_renderer_unrealize(renderers[i].renderer);
+        g_object_unref(renderers[i].renderer);
     }
+
+    visualiser_free_data();
+    g_object_unref(widget);
 }
 
 static void on_theme_changed(GObject*, GParamSpec*, gpointer data)
@@ -295,13 +1141,34 @@ void visualiser_init(GtkWidget* widget)
 {
     // Allocate buffers
     audio_data = calloc(FRAME_SIZE, sizeof(float));
-    for (int i = 0; i < N_FRAMES; ++i)
-        processed_frames[i] = calloc(FRAME_SIZE, sizeof(float));
+    scope_samples = calloc(FRAME_SIZE * 2, sizeof(float));
+    frame = calloc(FRAME_SIZE, sizeof(float));
+    bin_sums = calloc(MAX_ANALYSER_BINS + 1, sizeof(double));
+    analyser_history = calloc(MAX_ANALYSER_SIZE, sizeof(float));
+    analyser_window = malloc(sizeof(float) * MAX_ANALYSER_SIZE);
+    analyser_input = fftwf_alloc_real(MAX_ANALYSER_SIZE);
+    fft_output = fftwf_alloc_complex(MAX_ANALYSER_BINS);
+
+    // Plan for the current size now rather than on the first packet
+    apply_preference_changes();
+    update_analyser(true);
 
-    // Setup UI - macOS dark mode stubbed unsupported for now
+    visualiser_set_widget(widget);
+}
+
+void visualiser_set_widget(GtkWidget* widget)
+{
+    // Setup UI - macOS dark mode stubbed unsupported for now. Disconnected
+    // along with the widget, should it be swapped for the other renderer.
 #ifndef __APPLE__
     GtkSettings* settings = gtk_settings_get_default();
-    g_signal_connect(settings, "notify::gtk-application-prefer-dark-theme", G_CALLBACK(on_theme_changed), widget);
+    g_signal_connect_object(
+        settings,
+        "notify::gtk-application-prefer-dark-theme",
+        G_CALLBACK(on_theme_changed),
+        widget,
+        0
+    );
 #endif
     on_theme_changed(NULL, NULL, widget);
 }
@@ -320,11 +1187,35 @@ void visualiser_set_data(AudioPacket* packet)
 
         audio_data[i] = sum / (float)CHANNELS;
     }
+
+    // Analyse now, so the result depends on the audio rather than on how
+    // often GTK happens to redraw
+    apply_preference_changes();
+
+    if (preferences.is_frequency_domain)
+        add_fft_frames(audio_data, FRAME_SIZE);
+    else
+        add_time_domain_frame();
 }
 
 void visualiser_free_data()
 {
+    fftwf_destroy_plan(fft_plan);
+    fftwf_free(fft_output);
+    fftwf_free(analyser_input);
+    free(analyser_window);
+    free(analyser_history);
     free(audio_data);
-    for (int i = 0; i < N_FRAMES; ++i)
-        free(processed_frames[i]);
+    free(scope_samples);
+    free(bar_table);
+    free(bar_storage);
+    free(bar_rects);
+    free(bar_colours);
+    free(bar_kernels);
+    free(frame);
+    free(bin_sums);
+    if (fade_pattern != NULL)
+        cairo_pattern_destroy(fade_pattern);
+    if (spectrogram != NULL)
+        cairo_surface_destroy(spectrogram);
 }
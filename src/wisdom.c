@@ -0,0 +1,29 @@
+#include "wisdom.h"
+#include <adwaita.h>
+#include <fftw3.h>
+
+static gchar* get_wisdom_path()
+{
+    return g_build_filename(g_get_user_cache_dir(), "waveform", "fftw-wisdom", NULL);
+}
+
+void wisdom_load()
+{
+    // Not finding any is fine; it just means planning will take longer
+    gchar* path = get_wisdom_path();
+    fftwf_import_wisdom_from_filename(path);
+    g_free(path);
+}
+
+void wisdom_save()
+{
+    gchar* path = get_wisdom_path();
+    gchar* directory = g_path_get_dirname(path);
+
+    if (g_mkdir_with_parents(directory, 0755) != 0 ||
+        !fftwf_export_wisdom_to_filename(path))
+        g_warning("failed to save FFTW wisdom to %s", path);
+
+    g_free(directory);
+    g_free(path);
+}
@@ -2798,6 +2798,30 @@ extern DECLSPEC void SDLCALL Mix_CloseAudio(void);
  * Custom functions introduced for "Waveform" program
  */
 extern DECLSPEC int SDLCALL Mix_SetSpeed(double speed);
+extern DECLSPEC void SDLCALL Mix_GetDeviceTiming(int *frequency, int *buffer_frames);
+
+/* Decodes `music` straight into `data` in the device's format, without
+   playing it, and returns the number of bytes written (fewer than requested
+   once the track has ended) or -1 on error. */
+extern DECLSPEC int SDLCALL Mix_DecodeMusic(Mix_Music *music, void *data, int bytes);
+
+/* What Mix_ProbeMusicTags found in a file's headers. Missing tags are NULL,
+   and the strings are released by Mix_FreeMusicTags. */
+typedef struct Mix_MusicTags {
+    Mix_MusicType type;
+    int frequency;
+    char *title;
+    char *artist;
+    char *album;
+    char *copyright;
+} Mix_MusicTags;
+
+/* Reads the tags of the file at `path` (and its duration in seconds, or -1 if
+   the headers don't give it away) from only its header and trailer bytes,
+   without creating a decoder. Handles MP3, FLAC, Ogg Vorbis and Opus; returns
+   -1 for anything else, in which case fall back on Mix_LoadMUS. */
+extern DECLSPEC int SDLCALL Mix_ProbeMusicTags(const char *path, Mix_MusicTags *tags, double *duration);
+extern DECLSPEC void SDLCALL Mix_FreeMusicTags(Mix_MusicTags *tags);
 
 /* We'll use SDL for reporting errors */
 
@@ -0,0 +1,527 @@
+/*
+  SDL_mixer:  An audio mixer library based on the SDL library
+  Copyright (C) 1997-2024 Sam Lantinga <slouken@libsdl.org>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions:
+
+  1. The origin of this software must not be misrepresented; you must not
+     claim that you wrote the original software. If you use this software
+     in a product, an acknowledgment in the product documentation would be
+     appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+     misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+/* This file reads the tags and duration of a music file from only its header
+ * and trailer bytes, without creating a decoder. Custom for "Waveform". */
+
+#include "SDL_mixer.h"
+#include "music.h"
+#include "mp3utils.h"
+
+/* How far back from the end of an Ogg stream to look for its last page */
+#define OGG_TAIL_SIZE   65536
+
+/* Comment headers can carry cover art, which isn't worth reading just to
+ * get at the title - anything past this is skipped rather than buffered */
+#define MAX_COMMENT_SIZE    (256 * 1024)
+
+/* How far into an MP3's audio to look for the first frame header */
+#define MP3_SYNC_WINDOW 4096
+
+static Uint32 read_le32(const Uint8 *p)
+{
+    return (Uint32)p[0] | ((Uint32)p[1] << 8) | ((Uint32)p[2] << 16) | ((Uint32)p[3] << 24);
+}
+
+static Uint32 read_be32(const Uint8 *p)
+{
+    return ((Uint32)p[0] << 24) | ((Uint32)p[1] << 16) | ((Uint32)p[2] << 8) | (Uint32)p[3];
+}
+
+static Sint64 read_le64(const Uint8 *p)
+{
+    return (Sint64)((Uint64)read_le32(p) | ((Uint64)read_le32(p + 4) << 32));
+}
+
+/* Vorbis comments (shared by Ogg Vorbis, Opus and FLAC) */
+
+static void set_comment_tag(Mix_MusicMetaTags *tags, const char *comment, Uint32 length)
+{
+    static const struct {
+        const char *key;
+        Mix_MusicMetaTag tag;
+    } keys[] = {
+        { "TITLE", MIX_META_TITLE },
+        { "ARTIST", MIX_META_ARTIST },
+        { "ALBUM", MIX_META_ALBUM },
+        { "COPYRIGHT", MIX_META_COPYRIGHT }
+    };
+    size_t key_length = 0, i;
+    char *value;
+
+    while (key_length < length && comment[key_length] != '=') {
+        key_length++;
+    }
+    if (key_length == length) {
+        return;
+    }
+
+    for (i = 0; i < SDL_arraysize(keys); i++) {
+        if (key_length != SDL_strlen(keys[i].key) ||
+            SDL_strncasecmp(comment, keys[i].key, key_length) != 0) {
+            continue;
+        }
+
+        /* The value isn't null-terminated in the header */
+        value = SDL_malloc(length - key_length);
+        if (!value) {
+            return;
+        }
+        SDL_memcpy(value, comment + key_length + 1, length - key_length - 1);
+        value[length - key_length - 1] = '\0';
+        meta_tags_set(tags, keys[i].tag, value);
+        SDL_free(value);
+        return;
+    }
+}
+
+/* Same layout as vorbis_comment: a vendor string, then a count of "KEY=value"
+ * strings, each prefixed by its length. A truncated header still yields the
+ * comments that made it in. */
+static void parse_vorbis_comment(Mix_MusicMetaTags *tags, const Uint8 *data, size_t size)
+{
+    size_t offset;
+    Uint32 length, count, i;
+
+    if (size < 4) {
+        return;
+    }
+    offset = 4 + (size_t)read_le32(data);
+    if (offset + 4 > size) {
+        return;
+    }
+    count = read_le32(data + offset);
+    offset += 4;
+
+    for (i = 0; i < count && offset + 4 <= size; i++) {
+        length = read_le32(data + offset);
+        offset += 4;
+        if (length > size - offset) {
+            break;
+        }
+        set_comment_tag(tags, (const char *)data + offset, length);
+        offset += length;
+    }
+}
+
+/* FLAC: walk the metadata blocks after "fLaC", seeking over the ones we don't
+ * care about (pictures, seek tables, padding) */
+
+static int probe_flac(SDL_RWops *src, Mix_MusicMetaTags *tags, Mix_MusicTags *out, double *duration)
+{
+    Uint8 header[4], info[34];
+    Uint8 *comment;
+    Uint32 length, size;
+    Uint64 total_samples;
+    SDL_bool last = SDL_FALSE;
+    SDL_bool found_info = SDL_FALSE;
+
+    while (!last) {
+        if (SDL_RWread(src, header, 1, 4) != 4) {
+            break;
+        }
+        last = (header[0] & 0x80) != 0;
+        length = ((Uint32)header[1] << 16) | ((Uint32)header[2] << 8) | header[3];
+
+        switch (header[0] & 0x7F) {
+        case 0: /* STREAMINFO */
+            if (length < sizeof(info) || SDL_RWread(src, info, 1, sizeof(info)) != sizeof(info)) {
+                return Mix_SetError("Invalid FLAC stream info");
+            }
+            out->frequency = (int)(((Uint32)info[10] << 12) | ((Uint32)info[11] << 4) | (info[12] >> 4));
+            total_samples = ((Uint64)(info[13] & 0x0F) << 32) | read_be32(info + 14);
+            if (out->frequency > 0 && total_samples > 0) {
+                *duration = (double)total_samples / out->frequency;
+            }
+            SDL_RWseek(src, length - sizeof(info), RW_SEEK_CUR);
+            found_info = SDL_TRUE;
+            break;
+
+        case 4: /* VORBIS_COMMENT */
+            size = SDL_min(length, MAX_COMMENT_SIZE);
+            comment = SDL_malloc(size);
+            if (!comment) {
+                return SDL_OutOfMemory();
+            }
+            if (SDL_RWread(src, comment, 1, size) == size) {
+                parse_vorbis_comment(tags, comment, size);
+            }
+            SDL_free(comment);
+            SDL_RWseek(src, length - size, RW_SEEK_CUR);
+            break;
+
+        default:
+            SDL_RWseek(src, length, RW_SEEK_CUR);
+            break;
+        }
+    }
+
+    if (!found_info) {
+        return Mix_SetError("FLAC stream info missing");
+    }
+    out->type = MUS_FLAC;
+    return 0;
+}
+
+/* Ogg: reassemble the first two packets of the first logical stream from
+ * its pages (identification and comment headers), then take the duration
+ * from the granule position of the last page. */
+
+typedef struct {
+    SDL_RWops *src;
+    Uint32 serial;
+    SDL_bool has_serial;
+    Uint8 lacing[255];
+    int segments;
+    int segment;
+} OggReader;
+
+static SDL_bool read_ogg_page(OggReader *reader)
+{
+    Uint8 header[27];
+    Uint32 serial, body;
+    int i;
+
+    for (;;) {
+        if (SDL_RWread(reader->src, header, 1, sizeof(header)) != sizeof(header) ||
+            SDL_memcmp(header, "OggS", 4) != 0) {
+            return SDL_FALSE;
+        }
+        reader->segments = header[26];
+        reader->segment = 0;
+        if (SDL_RWread(reader->src, reader->lacing, 1, reader->segments) != (size_t)reader->segments) {
+            return SDL_FALSE;
+        }
+
+        serial = read_le32(header + 14);
+        if (!reader->has_serial) {
+            reader->serial = serial;
+            reader->has_serial = SDL_TRUE;
+        }
+        if (serial == reader->serial) {
+            return SDL_TRUE;
+        }
+
+        /* Some other multiplexed stream */
+        for (i = 0, body = 0; i < reader->segments; i++) {
+            body += reader->lacing[i];
+        }
+        SDL_RWseek(reader->src, body, RW_SEEK_CUR);
+    }
+}
+
+/* Returns the packet in a new buffer, or NULL. Bytes past MAX_COMMENT_SIZE
+ * are skipped, so `size` can be less than the full packet. */
+static Uint8 *read_ogg_packet(OggReader *reader, size_t *size)
+{
+    Uint8 *packet = NULL, *grown;
+    size_t length = 0, take;
+    int lace;
+
+    do {
+        while (reader->segment == reader->segments) {
+            if (!read_ogg_page(reader)) {
+                SDL_free(packet);
+                return NULL;
+            }
+        }
+        lace = reader->lacing[reader->segment++];
+
+        take = (length < MAX_COMMENT_SIZE) ? SDL_min((size_t)lace, MAX_COMMENT_SIZE - length) : 0;
+        if (take > 0) {
+            grown = SDL_realloc(packet, length + take);
+            if (!grown) {
+                SDL_free(packet);
+                return NULL;
+            }
+            packet = grown;
+            if (SDL_RWread(reader->src, packet + length, 1, take) != take) {
+                SDL_free(packet);
+                return NULL;
+            }
+            length += take;
+        }
+        if ((size_t)lace > take) {
+            SDL_RWseek(reader->src, lace - take, RW_SEEK_CUR);
+        }
+    } while (lace == 255);
+
+    *size = length;
+    return packet;
+}
+
+static Sint64 find_last_granule(SDL_RWops *src, Uint32 serial)
+{
+    Uint8 *tail;
+    Sint64 file_size, tail_size, granule = -1;
+    Sint64 i;
+
+    file_size = SDL_RWsize(src);
+    if (file_size <= 0) {
+        return -1;
+    }
+    tail_size = SDL_min(file_size, OGG_TAIL_SIZE);
+    tail = SDL_malloc((size_t)tail_size);
+    if (!tail) {
+        return -1;
+    }
+
+    if (SDL_RWseek(src, file_size - tail_size, RW_SEEK_SET) >= 0 &&
+        SDL_RWread(src, tail, 1, (size_t)tail_size) == (size_t)tail_size) {
+        for (i = tail_size - 27; i >= 0; i--) {
+            if (SDL_memcmp(tail + i, "OggS", 4) == 0 && read_le32(tail + i + 14) == serial) {
+                granule = read_le64(tail + i + 6);
+                if (granule >= 0) {
+                    break;
+                }
+            }
+        }
+    }
+
+    SDL_free(tail);
+    return granule;
+}
+
+static int probe_ogg(SDL_RWops *src, Mix_MusicMetaTags *tags, Mix_MusicTags *out, double *duration)
+{
+    OggReader reader;
+    Uint8 *packet;
+    size_t size;
+    Sint64 granule, pre_skip = 0;
+    int granule_rate;
+
+    SDL_zero(reader);
+    reader.src = src;
+
+    /* Identification header */
+    packet = read_ogg_packet(&reader, &size);
+    if (!packet) {
+        return Mix_SetError("Couldn't read Ogg identification header");
+    }
+    if (size >= 16 && SDL_memcmp(packet, "\x01vorbis", 7) == 0) {
+        out->type = MUS_OGG;
+        out->frequency = (int)read_le32(packet + 12);
+        granule_rate = out->frequency;
+    } else if (size >= 12 && SDL_memcmp(packet, "OpusHead", 8) == 0) {
+        /* Opus always decodes at 48kHz, whatever the input rate was */
+        out->type = MUS_OPUS;
+        out->frequency = 48000;
+        granule_rate = 48000;
+        pre_skip = packet[10] | (packet[11] << 8);
+    } else {
+        SDL_free(packet);
+        return Mix_SetError("Unsupported Ogg stream");
+    }
+    SDL_free(packet);
+
+    /* Comment header */
+    packet = read_ogg_packet(&reader, &size);
+    if (packet) {
+        if (out->type == MUS_OGG && size >= 7 && SDL_memcmp(packet, "\x03vorbis", 7) == 0) {
+            parse_vorbis_comment(tags, packet + 7, size - 7);
+        } else if (out->type == MUS_OPUS && size >= 8 && SDL_memcmp(packet, "OpusTags", 8) == 0) {
+            parse_vorbis_comment(tags, packet + 8, size - 8);
+        }
+        SDL_free(packet);
+    }
+
+    granule = find_last_granule(src, reader.serial);
+    if (granule > pre_skip && granule_rate > 0) {
+        *duration = (double)(granule - pre_skip) / granule_rate;
+    }
+    return 0;
+}
+
+/* MP3: the tags come from mp3_read_tags (which also trims them off the
+ * stream), then the duration from the Xing/Info or VBRI header of the first
+ * frame, or failing that, from the bitrate assuming it's constant */
+
+static const int mp3_bitrates[2][3][15] = {
+    { /* MPEG-1 */
+        { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+        { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+    },
+    { /* MPEG-2 and 2.5 */
+        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+    }
+};
+
+static const int mp3_sample_rates[3] = { 44100, 48000, 32000 };
+
+static void probe_mp3_duration(struct mp3file_t *fil, Mix_MusicTags *out, double *duration)
+{
+    Uint8 buf[MP3_SYNC_WINDOW];
+    size_t length, i;
+    int version, layer, bitrate_index, rate_index, mono;
+    int bitrate, samples_per_frame;
+    size_t side_info;
+    const Uint8 *frame;
+    Uint32 frames = 0;
+
+    MP3_RWseek(fil, 0, RW_SEEK_SET);
+    length = MP3_RWread(fil, buf, 1, sizeof(buf));
+
+    for (i = 0; i + 4 <= length; i++) {
+        frame = buf + i;
+        if (frame[0] != 0xFF || (frame[1] & 0xE0) != 0xE0) {
+            continue;
+        }
+        version = (frame[1] >> 3) & 3;    /* 0 = 2.5, 2 = 2, 3 = 1 */
+        layer = 4 - ((frame[1] >> 1) & 3);
+        bitrate_index = frame[2] >> 4;
+        rate_index = (frame[2] >> 2) & 3;
+        if (version == 1 || layer == 4 || bitrate_index == 0 || bitrate_index == 15 || rate_index == 3) {
+            continue;
+        }
+        mono = (frame[3] >> 6) == 3;
+
+        out->frequency = mp3_sample_rates[rate_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+        bitrate = mp3_bitrates[version == 3 ? 0 : 1][layer - 1][bitrate_index];
+        samples_per_frame = layer == 1 ? 384 : (layer == 3 && version != 3) ? 576 : 1152;
+
+        /* A VBR encoder leaves the frame count in an otherwise silent first
+           frame, just after the side information */
+        side_info = version == 3 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+        if (i + 4 + side_info + 12 <= length &&
+            (SDL_memcmp(frame + 4 + side_info, "Xing", 4) == 0 ||
+             SDL_memcmp(frame + 4 + side_info, "Info", 4) == 0) &&
+            (read_be32(frame + 4 + side_info + 4) & 1)) {
+            frames = read_be32(frame + 4 + side_info + 8);
+        } else if (i + 36 + 18 <= length && SDL_memcmp(frame + 36, "VBRI", 4) == 0) {
+            frames = read_be32(frame + 36 + 14);
+        }
+
+        if (frames > 0) {
+            *duration = (double)frames * samples_per_frame / out->frequency;
+        } else {
+            *duration = (double)(fil->length - (Sint64)i) * 8.0 / (bitrate * 1000.0);
+        }
+        return;
+    }
+}
+
+static int probe_mp3(SDL_RWops *src, Mix_MusicMetaTags *tags, Mix_MusicTags *out, double *duration)
+{
+    struct mp3file_t fil;
+
+    if (MP3_RWinit(&fil, src) < 0) {
+        return -1;
+    }
+    if (mp3_read_tags(tags, &fil, SDL_FALSE) < 0) {
+        return Mix_SetError("Corrupt MP3 music tags");
+    }
+    probe_mp3_duration(&fil, out, duration);
+    out->type = MUS_MP3;
+    return 0;
+}
+
+/* A FLAC file can (against the spec) start with an ID3v2 tag, so look past it
+ * before deciding it's an MP3 */
+static SDL_bool is_flac_after_id3v2(SDL_RWops *src, const Uint8 *magic)
+{
+    Sint64 length;
+    Uint8 flac[4];
+
+    length = 10 + (((Sint64)(magic[6] & 0x7F) << 21) | ((magic[7] & 0x7F) << 14) |
+                   ((magic[8] & 0x7F) << 7) | (magic[9] & 0x7F));
+    if (magic[5] & 0x10) {
+        length += 10; /* footer */
+    }
+
+    if (SDL_RWseek(src, length, RW_SEEK_SET) < 0 || SDL_RWread(src, flac, 1, 4) != 4 ||
+        SDL_memcmp(flac, "fLaC", 4) != 0) {
+        SDL_RWseek(src, 0, RW_SEEK_SET);
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+int Mix_ProbeMusicTags(const char *path, Mix_MusicTags *tags, double *duration)
+{
+    SDL_RWops *src;
+    Mix_MusicMetaTags meta;
+    Uint8 magic[10];
+    int result;
+
+    if (!tags || !duration) {
+        return Mix_SetError("Tags or duration parameter was NULL");
+    }
+    SDL_zerop(tags);
+    *duration = -1.0;
+
+    src = SDL_RWFromFile(path, "rb");
+    if (!src) {
+        return -1;
+    }
+    if (SDL_RWread(src, magic, 1, sizeof(magic)) != sizeof(magic)) {
+        SDL_RWclose(src);
+        return Mix_SetError("Couldn't read first 10 bytes of audio data");
+    }
+
+    meta_tags_init(&meta);
+    if (SDL_memcmp(magic, "fLaC", 4) == 0) {
+        SDL_RWseek(src, 4, RW_SEEK_SET);
+        result = probe_flac(src, &meta, tags, duration);
+    } else if (SDL_memcmp(magic, "OggS", 4) == 0) {
+        SDL_RWseek(src, 0, RW_SEEK_SET);
+        result = probe_ogg(src, &meta, tags, duration);
+    } else if (SDL_memcmp(magic, "ID3", 3) == 0 && is_flac_after_id3v2(src, magic)) {
+        result = probe_flac(src, &meta, tags, duration);
+    } else if (SDL_memcmp(magic, "ID3", 3) == 0 ||
+               (magic[0] == 0xFF && (magic[1] & 0xE6) == 0xE2)) {
+        SDL_RWseek(src, 0, RW_SEEK_SET);
+        result = probe_mp3(src, &meta, tags, duration);
+    } else {
+        result = Mix_SetError("Music type can't be probed");
+    }
+    SDL_RWclose(src);
+
+    if (result < 0) {
+        meta_tags_clear(&meta);
+        SDL_zerop(tags);
+        *duration = -1.0;
+        return -1;
+    }
+
+    /* Hand over the strings as they are */
+    tags->title = meta.tags[MIX_META_TITLE];
+    tags->artist = meta.tags[MIX_META_ARTIST];
+    tags->album = meta.tags[MIX_META_ALBUM];
+    tags->copyright = meta.tags[MIX_META_COPYRIGHT];
+    return 0;
+}
+
+void Mix_FreeMusicTags(Mix_MusicTags *tags)
+{
+    if (!tags) {
+        return;
+    }
+    SDL_free(tags->title);
+    SDL_free(tags->artist);
+    SDL_free(tags->album);
+    SDL_free(tags->copyright);
+    SDL_zerop(tags);
+}
+
+/* vi: set ts=4 sw=4 expandtab: */
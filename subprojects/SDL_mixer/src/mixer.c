@@ -1820,6 +1820,19 @@ int Mix_SetSpeed(double speed)
     return 0;
 }
 
+void Mix_GetDeviceTiming(int *frequency, int *buffer_frames)
+{
+    /* The rate the device is really running at (see Mix_SetSpeed), and how
+       many frames each callback fills, i.e. how far post-mix effects run
+       ahead of what can be heard */
+    if (frequency) {
+        *frequency = mixer.freq;
+    }
+    if (buffer_frames) {
+        *buffer_frames = mixer.samples;
+    }
+}
+
 /* end of mixer.c ... */
 
 /* vi: set ts=4 sw=4 expandtab: */
@@ -1577,4 +1577,35 @@ int Mix_EachSoundFont(Mix_EachSoundFontCallback function, void *data)
     return (soundfonts_found > 0);
 }
 
+/**
+ * Custom functions introduced for "Waveform" program
+ */
+
+int Mix_DecodeMusic(Mix_Music *music, void *data, int bytes)
+{
+    int left;
+
+    if (!music) {
+        return Mix_SetError("music parameter was NULL");
+    }
+    if (!music->interface->GetAudio) {
+        return Mix_SetError("Music type can't be decoded");
+    }
+
+    /* Start from the beginning (and don't loop) on the first call. The music
+       must never be handed to Mix_PlayMusic, as this bypasses the mixer. */
+    if (!music->playing) {
+        if (music->interface->Play && music->interface->Play(music->context, 1) < 0) {
+            return -1;
+        }
+        music->playing = SDL_TRUE;
+    }
+
+    left = music->interface->GetAudio(music->context, data, bytes);
+    if (left < 0) {
+        return -1;
+    }
+    return bytes - left;
+}
+
 /* vi: set ts=4 sw=4 expandtab: */